@@ -0,0 +1,123 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "alias.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+int alias_init(struct alias_table *table, int size)
+{
+	table->aliases = NULL;
+	table->size = 0;
+	table->max = 0;
+	table->clock = 0;
+
+	if (size <= 0)
+		return 0;
+	if (size > ALIAS_MAX)
+		size = ALIAS_MAX;
+
+	if ((table->aliases = calloc(size, sizeof(struct topic_alias))) == NULL) {
+		fprintf(stderr, "No memory left.\n");
+		return -1;
+	}
+	table->size = size;
+
+	return 0;
+}
+
+// Aliases only live as long as the network connection,
+// so every new connection starts with an empty table.
+void alias_reset(struct alias_table *table, int broker_max)
+{
+	int i;
+
+	for (i = 0; i < table->size; i++) {
+		free(table->aliases[i].topic);
+		table->aliases[i].topic = NULL;
+		table->aliases[i].last_used = 0;
+	}
+	table->clock = 0;
+
+	if (broker_max < table->size)
+		table->max = broker_max;
+	else
+		table->max = table->size;
+}
+
+// Returns the alias number for the topic, 0 when no alias can be used or -1 on memory error.
+// known is set when the broker already has the topic mapped to that alias,
+// otherwise the least recently used alias is (re)assigned to the topic.
+int alias_get(struct alias_table *table, const char *topic, bool *known)
+{
+	struct topic_alias *alias, *lru = NULL;
+	int i;
+
+	*known = false;
+
+	if (table->max <= 0)
+		return 0;
+
+	table->clock++;
+	for (i = 0; i < table->max; i++) {
+		alias = &table->aliases[i];
+		if (alias->topic && !strcmp(alias->topic, topic)) {
+			alias->last_used = table->clock;
+			*known = true;
+			return i + 1;
+		}
+		if (!lru || alias->last_used < lru->last_used)
+			lru = alias;
+	}
+
+	free(lru->topic);
+	lru->topic = strdup(topic);
+	if (!lru->topic) {
+		fprintf(stderr, "Error: No memory left.\n");
+		return -1;
+	}
+	lru->last_used = table->clock;
+
+	return (lru - table->aliases) + 1;
+}
+
+void alias_forget(struct alias_table *table, int alias)
+{
+	if (alias < 1 || alias > table->max)
+		return;
+
+	free(table->aliases[alias - 1].topic);
+	table->aliases[alias - 1].topic = NULL;
+	table->aliases[alias - 1].last_used = 0;
+}
+
+void alias_cleanup(struct alias_table *table)
+{
+	alias_reset(table, 0);
+	free(table->aliases);
+	table->aliases = NULL;
+	table->size = 0;
+}
@@ -0,0 +1,50 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <stdbool.h>
+
+#define ALIAS_MAX 65535
+
+struct topic_alias {
+	char *topic;
+	unsigned long last_used;
+};
+
+struct alias_table {
+	struct topic_alias *aliases;
+	int size;						// Configured number of aliases
+	int max;						// Aliases accepted by the broker
+	unsigned long clock;
+};
+
+int alias_init(struct alias_table *, int);
+void alias_reset(struct alias_table *, int);
+int alias_get(struct alias_table *, const char *, bool *);
+void alias_forget(struct alias_table *, int);
+void alias_cleanup(struct alias_table *);
+
+#endif
@@ -48,7 +48,7 @@ int serialport_init(const char* serialport, int baud)
         perror("serialport_init: Couldn't get term attributes");
         return -1;
     }
-    speed_t brate = baud; // let you override switch below if needed
+    speed_t brate = B0;  // anything not listed below goes through termios2
     switch(baud) {
     case 4800:   brate=B4800;   break;
     case 9600:   brate=B9600;   break;
@@ -62,9 +62,20 @@ int serialport_init(const char* serialport, int baud)
     case 38400:  brate=B38400;  break;
     case 57600:  brate=B57600;  break;
     case 115200: brate=B115200; break;
+#ifdef B230400
+    case 230400: brate=B230400; break;
+#endif
+#ifdef B460800
+    case 460800: brate=B460800; break;
+#endif
+#ifdef B921600
+    case 921600: brate=B921600; break;
+#endif
+    }
+    if (brate != B0) {
+        cfsetispeed(&toptions, brate);
+        cfsetospeed(&toptions, brate);
     }
-    cfsetispeed(&toptions, brate);
-    cfsetospeed(&toptions, brate);
 
     // 8N1
     toptions.c_cflag &= ~PARENB;
@@ -93,6 +104,11 @@ int serialport_init(const char* serialport, int baud)
         return -1;
     }
 
+    if (brate == B0 && serialport_set_custom_baud(fd, baud) < 0) {
+        close(fd);
+        return -1;
+    }
+
     return fd;
 }
 
@@ -180,8 +196,9 @@ int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeou
 }
 
 //
+// the Arduino resets when the port is opened, callers should wait
+// for it to boot (about 2 secs) before flushing
 int serialport_flush(int fd)
 {
-    sleep(2); //required to make flush work, for some reason
     return tcflush(fd, TCIOFLUSH);
 }
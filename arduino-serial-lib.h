@@ -21,5 +21,7 @@ int serialport_printlf(int fd, const char* str);
 int serialport_printbytelf(int fd, uint8_t b);
 int serialport_read_until(int fd, char* buf, char until, int buf_max,int timeout);
 int serialport_flush(int fd);
+int serialport_set_custom_baud(int fd, int baud);
+int serialport_low_latency(int fd);
 
 #endif
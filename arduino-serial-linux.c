@@ -0,0 +1,56 @@
+/*
+arduino-serial-lib -- simple library for reading/writing serial ports
+
+Original work Copyleft (c) 2006-2013, Tod E. Kurt, http://todbot.com/blog/
+https://github.com/todbot/arduino-serial
+
+Modified work Copyleft (c) Marcelo Aquino, https://github.com/mapnull
+
+*/
+
+// Linux only parts, kept apart because <asm/termbits.h> clashes with <termios.h>
+
+#include "arduino-serial-lib.h"
+
+#include <stdio.h>    // Standard input/output definitions 
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+// sets any baud rate, not only the B* constants, through termios2 and BOTHER
+// returns 0, or -1 on error
+int serialport_set_custom_baud(int fd, int baud)
+{
+    struct termios2 toptions;
+
+    if (ioctl(fd, TCGETS2, &toptions) < 0) {
+        perror("serialport_set_custom_baud: Couldn't get term attributes");
+        return -1;
+    }
+
+    toptions.c_cflag &= ~CBAUD;
+    toptions.c_cflag |= BOTHER;
+    toptions.c_ispeed = baud;
+    toptions.c_ospeed = baud;
+
+    if (ioctl(fd, TCSETS2, &toptions) < 0) {
+        perror("serialport_set_custom_baud: Couldn't set term attributes");
+        return -1;
+    }
+    return 0;
+}
+
+// asks the driver to push received bytes right away (ftdi and similar
+// usb adapters otherwise hold them up to 16 msec)
+// returns 0, or -1 when the driver does not support it
+int serialport_low_latency(int fd)
+{
+    struct serial_struct serial;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0)
+        return -1;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) < 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "bloom.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+int bloom_init(struct bloom *filter, int size)
+{
+	filter->size = size;
+	filter->hits = 0;
+	filter->misses = 0;
+	filter->false_positives = 0;
+	if ((filter->bits = calloc(size / 8, 1)) == NULL) {
+		fprintf(stderr, "No memory left.\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Double hashing, djb2 and fnv-1a give the BLOOM_HASHES bits of a key
+static void _bloom_hash(const char *key, unsigned int *h1, unsigned int *h2)
+{
+	*h1 = 5381;
+	*h2 = 2166136261u;
+	for (; *key; key++) {
+		*h1 = ((*h1 << 5) + *h1) + (unsigned char)*key;
+		*h2 = (*h2 ^ (unsigned char)*key) * 16777619u;
+	}
+	*h2 |= 1;
+}
+
+void bloom_add(struct bloom *filter, const char *key)
+{
+	unsigned int h1, h2, bit;
+	int i;
+
+	if (!filter->bits)
+		return;
+	_bloom_hash(key, &h1, &h2);
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (h1 + i * h2) % filter->size;
+		filter->bits[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+// False when the key was never added, true when it may have been
+bool bloom_check(struct bloom *filter, const char *key)
+{
+	unsigned int h1, h2, bit;
+	int i;
+
+	if (!filter->bits)
+		return true;
+	_bloom_hash(key, &h1, &h2);
+	for (i = 0; i < BLOOM_HASHES; i++) {
+		bit = (h1 + i * h2) % filter->size;
+		if (!(filter->bits[bit / 8] & (1 << (bit % 8)))) {
+			filter->hits++;
+			return false;
+		}
+	}
+	filter->misses++;
+	return true;
+}
+
+void bloom_print_stats(struct bloom *filter, const char *name)
+{
+	printf("%s cache - hits: %lu, misses: %lu, false positives: %lu\n", name, filter->hits, filter->misses, filter->false_positives);
+}
+
+void bloom_cleanup(struct bloom *filter)
+{
+	free(filter->bits);
+	filter->bits = NULL;
+}
@@ -0,0 +1,47 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+
+#define BLOOM_BITS 65536				// 8KB, ~0.5% false positives with 5000 ids
+#define BLOOM_HASHES 4
+
+struct bloom {
+	unsigned char *bits;				// NULL when not used
+	int size;							// In bits
+	unsigned long hits;					// Answered absent
+	unsigned long misses;				// Maybe present
+	unsigned long false_positives;		// Misses that were absent, counted by the caller
+};
+
+int bloom_init(struct bloom *, int);
+void bloom_add(struct bloom *, const char *);
+bool bloom_check(struct bloom *, const char *);
+void bloom_print_stats(struct bloom *, const char *);
+void bloom_cleanup(struct bloom *);
+
+#endif
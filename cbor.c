@@ -0,0 +1,114 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "cbor.h"
+
+#include <string.h>
+
+// Minimal RFC 7049 encoder writing into a caller provided buffer.
+// Nothing is allocated, an overflow only sets the error flag.
+
+void cbor_init(struct cbor *cb, uint8_t *buf, int size)
+{
+	cb->buf = buf;
+	cb->size = size;
+	cb->len = 0;
+	cb->error = false;
+}
+
+static void _cbor_head(struct cbor *cb, int major, uint64_t value)
+{
+	int bytes, i;
+
+	if (value < 24)
+		bytes = 0;
+	else if (value <= 0xFF)
+		bytes = 1;
+	else if (value <= 0xFFFF)
+		bytes = 2;
+	else if (value <= 0xFFFFFFFF)
+		bytes = 4;
+	else
+		bytes = 8;
+
+	if (cb->error || cb->len + 1 + bytes > cb->size) {
+		cb->error = true;
+		return;
+	}
+
+	if (!bytes) {
+		cb->buf[cb->len++] = (major << 5) | value;
+		return;
+	}
+	cb->buf[cb->len++] = (major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+	for (i = bytes - 1; i >= 0; i--)
+		cb->buf[cb->len++] = (value >> (i * 8)) & 0xFF;
+}
+
+void cbor_int(struct cbor *cb, long long value)
+{
+	if (value < 0)
+		_cbor_head(cb, CBOR_NINT, -1 - value);
+	else
+		_cbor_head(cb, CBOR_UINT, value);
+}
+
+void cbor_text(struct cbor *cb, const char *str)
+{
+	int len;
+
+	if (!str)
+		str = "";
+	len = strlen(str);
+
+	_cbor_head(cb, CBOR_TEXT, len);
+	if (cb->error || cb->len + len > cb->size) {
+		cb->error = true;
+		return;
+	}
+	memcpy(&cb->buf[cb->len], str, len);
+	cb->len += len;
+}
+
+void cbor_array(struct cbor *cb, int items)
+{
+	_cbor_head(cb, CBOR_ARRAY, items);
+}
+
+void cbor_bool(struct cbor *cb, bool value)
+{
+	if (cb->error || cb->len + 1 > cb->size) {
+		cb->error = true;
+		return;
+	}
+	cb->buf[cb->len++] = value ? 0xF5 : 0xF4;
+}
+
+// Returns the encoded length, or -1 if the buffer was too small
+int cbor_len(struct cbor *cb)
+{
+	if (cb->error)
+		return -1;
+	return cb->len;
+}
@@ -0,0 +1,180 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "codec.h"
+#include "device.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *formats_name[CODEC_FORMATS] = {"raw", "plain", "json", "line"};
+
+// %v value, %u unit, %t module type, %d device id, %m module id
+static const char *formats_pattern[CODEC_FORMATS] = {
+	"%v",
+	"%v",
+	"{\"value\":%v,\"unit\":\"%u\",\"device\":\"%d\",\"module\":\"%m\"}",
+	"%t,device=%d,module=%m value=%v"
+};
+
+// Readings the bridge understands, other module types are passed through
+static const struct codec codecs[MODULES_NAME_SIZE] = {
+	[MODULE_TEMP] = {"C", 1, -55, 125},
+	[MODULE_LDR] = {"raw", 0, 0, 1023},
+	[MODULE_HUM] = {"%", 1, 0, 100},
+	[MODULE_AMP] = {"A", 2, -100, 100},
+	[MODULE_VOLT] = {"V", 2, -1000, 1000},
+	[MODULE_WATT] = {"W", 1, -100000, 100000},
+	[MODULE_RAIN] = {"raw", 0, 0, 1023},
+	[MODULE_SONAR] = {"cm", 0, 0, 1000},
+};
+
+static struct codec_template templates[CODEC_FORMATS];
+
+// Split a pattern once into literals and fields, rendering is then a plain copy
+static void _codec_compile(const char *pattern, struct codec_template *tpl)
+{
+	struct codec_part *part;
+	const char *ptr;
+	int field;
+
+	tpl->len = 0;
+	for (ptr = pattern; *ptr && tpl->len < CODEC_PARTS; ) {
+		part = &tpl->parts[tpl->len++];
+		if (*ptr != '%') {
+			part->field = CODEC_LITERAL;
+			part->text = ptr;
+			part->len = strcspn(ptr, "%");
+			ptr += part->len;
+			continue;
+		}
+
+		switch (ptr[1]) {
+			case 'v':
+				field = CODEC_VALUE;
+				break;
+			case 'u':
+				field = CODEC_UNIT;
+				break;
+			case 't':
+				field = CODEC_TYPE;
+				break;
+			case 'd':
+				field = CODEC_DEVICE;
+				break;
+			case 'm':
+				field = CODEC_MODULE;
+				break;
+			default:
+				field = CODEC_LITERAL;		// Unknown escape, kept as is
+				break;
+		}
+		part->field = field;
+		part->text = ptr;
+		part->len = 1;
+		ptr += field == CODEC_LITERAL ? 1 : 2;
+	}
+}
+
+void codec_init(void)
+{
+	int i;
+
+	for (i = 0; i < CODEC_FORMATS; i++)
+		_codec_compile(formats_pattern[i], &templates[i]);
+}
+
+// Format from its name, -1 if unknown
+int codec_format(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CODEC_FORMATS; i++) {
+		if (!strcmp(formats_name[i], name))
+			return i;
+	}
+	return -1;
+}
+
+// NULL if the module type has no codec
+const struct codec *codec_get(int type)
+{
+	if (type < 0 || type >= MODULES_NAME_SIZE || !codecs[type].unit)
+		return NULL;
+	return &codecs[type];
+}
+
+// Parse a raw reading, scaled, into value.
+// Returns 1 if it is not a number or out of the range of its type.
+int codec_parse(const struct codec *codec, const char *raw, double scale, double *value)
+{
+	char *end;
+
+	*value = strtod(raw, &end);
+	if (end == raw || *end || *value != *value)
+		return 1;
+
+	*value *= scale;
+	if (*value < codec->min || *value > codec->max)
+		return 1;
+
+	return 0;
+}
+
+// Render a reading with the template of format into buf.
+// Returns the length, -1 if it did not fit.
+int codec_render(int format, const struct codec_reading *reading, char *buf, int size)
+{
+	const struct codec_template *tpl = &templates[format];
+	const struct codec_part *part;
+	struct fmt f;
+	int i;
+
+	fmt_init(&f, buf, size);
+	for (i = 0; i < tpl->len; i++) {
+		part = &tpl->parts[i];
+		switch (part->field) {
+			case CODEC_LITERAL:
+				fmt_mem(&f, part->text, part->len);
+				break;
+			case CODEC_VALUE:
+				fmt_fixed(&f, reading->value, reading->codec->decimals);
+				break;
+			case CODEC_UNIT:
+				fmt_str(&f, reading->codec->unit);
+				break;
+			case CODEC_TYPE:
+				fmt_str(&f, reading->type);
+				break;
+			case CODEC_DEVICE:
+				fmt_str(&f, reading->device);
+				break;
+			case CODEC_MODULE:
+				fmt_str(&f, reading->module);
+				break;
+		}
+	}
+	return fmt_end(&f);
+}
@@ -0,0 +1,78 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "fmt.h"
+
+#define CODEC_RAW 0						// Published as received
+#define CODEC_PLAIN 1
+#define CODEC_JSON 2
+#define CODEC_LINE 3					// InfluxDB line protocol
+#define CODEC_FORMATS 4
+
+#define CODEC_BUF_SIZE 128
+#define CODEC_PARTS 16
+
+#define CODEC_LITERAL 0
+#define CODEC_VALUE 1
+#define CODEC_UNIT 2
+#define CODEC_TYPE 3
+#define CODEC_DEVICE 4
+#define CODEC_MODULE 5
+
+struct codec {
+	const char *unit;
+	int decimals;
+	double min;
+	double max;
+};
+
+struct codec_part {
+	int field;
+	const char *text;				// CODEC_LITERAL only
+	int len;
+};
+
+struct codec_template {
+	struct codec_part parts[CODEC_PARTS];
+	int len;
+};
+
+struct codec_reading {
+	double value;
+	const struct codec *codec;
+	const char *type;
+	const char *device;
+	const char *module;
+};
+
+void codec_init(void);
+int codec_format(const char *);
+const struct codec *codec_get(int);
+int codec_parse(const struct codec *, const char *, double, double *);
+int codec_render(int, const struct codec_reading *, char *, int);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "command.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Queue a command for a device, the window is allocated on first use.
+// With coalesce, a command still pending for the same module is replaced
+// and its sequence number and origin returned in replaced (-1 otherwise)
+// and replaced_origin.
+// Returns 1 if the sequence number is already in use or all slots are busy.
+int command_add(struct command_window **window, char *md_id, int seq, char *value, bool coalesce, int origin
+	, int *replaced, int *replaced_origin)
+{
+	struct command_window *w;
+	struct command *c, *slot = NULL, *same = NULL;
+	char *copy;
+	int i;
+
+	*replaced = -1;
+
+	if (!*window) {
+		*window = calloc(1, sizeof(struct command_window));
+		if (!*window) {
+			fprintf(stderr, "Error: No memory left.\n");
+			return -1;
+		}
+	}
+	w = *window;
+
+	for (i = 0; i < COMMAND_SLOTS; i++) {
+		c = &w->slots[i];
+		if (c->state == COMMAND_FREE) {
+			if (!slot)
+				slot = c;
+		} else if (c->seq == seq) {
+			return 1;
+		} else if (coalesce && c->state == COMMAND_PENDING && !strcmp(c->md_id, md_id)) {
+			same = c;
+		}
+	}
+
+	if (same) {
+		copy = strdup(value);
+		if (!copy) {
+			fprintf(stderr, "Error: No memory left.\n");
+			return -1;
+		}
+		free(same->value);
+		same->value = copy;
+		*replaced = same->seq;
+		*replaced_origin = same->origin;
+		same->seq = seq;		// Keeps its place in line
+		same->origin = origin;
+		return 0;
+	}
+	if (!slot)
+		return 1;
+
+	slot->value = strdup(value);
+	if (!slot->value) {
+		fprintf(stderr, "Error: No memory left.\n");
+		return -1;
+	}
+	strcpy(slot->md_id, md_id);
+	slot->seq = seq;
+	slot->origin = origin;
+	slot->tries = 0;
+	slot->deadline = 0;
+	slot->order = w->clock++;
+	slot->state = COMMAND_PENDING;
+
+	return 0;
+}
+
+// Oldest pending command, if the window has room for one more in flight
+struct command *command_next(struct command_window *w, int window)
+{
+	struct command *c, *next = NULL;
+	int i;
+
+	if (!w || w->inflight >= window)
+		return NULL;
+
+	for (i = 0; i < COMMAND_SLOTS; i++) {
+		c = &w->slots[i];
+		if (c->state == COMMAND_PENDING && (!next || c->order < next->order))
+			next = c;
+	}
+	return next;
+}
+
+// Mark a command as sent (again), the ack is expected before deadline
+void command_sent(struct command_window *w, struct command *c, long long deadline)
+{
+	if (c->state == COMMAND_PENDING)
+		w->inflight++;
+	c->state = COMMAND_INFLIGHT;
+	c->tries++;
+	c->deadline = deadline;
+}
+
+struct command *command_find(struct command_window *w, int seq)
+{
+	int i;
+
+	if (!w)
+		return NULL;
+
+	for (i = 0; i < COMMAND_SLOTS; i++) {
+		if (w->slots[i].state == COMMAND_INFLIGHT && w->slots[i].seq == seq)
+			return &w->slots[i];
+	}
+	return NULL;
+}
+
+void command_free(struct command_window *w, struct command *c)
+{
+	if (c->state == COMMAND_INFLIGHT)
+		w->inflight--;
+	c->state = COMMAND_FREE;
+	free(c->value);
+	c->value = NULL;
+}
+
+void command_cleanup(struct command_window **window)
+{
+	int i;
+
+	if (!*window)
+		return;
+
+	for (i = 0; i < COMMAND_SLOTS; i++)
+		free((*window)->slots[i].value);
+	free(*window);
+	*window = NULL;
+}
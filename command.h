@@ -0,0 +1,65 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdbool.h>
+
+#include "device.h"
+
+#define COMMAND_FREE 0
+#define COMMAND_PENDING 1				// Waiting for room in the window
+#define COMMAND_INFLIGHT 2				// Sent, waiting for the ack
+
+#define COMMAND_SLOTS 16
+#define COMMAND_WINDOW 4
+#define COMMAND_TIMEOUT 500				// msecs
+#define COMMAND_RETRIES 3
+
+struct command {
+	int state;
+	int seq;
+	char md_id[DEVICE_MD_ID_SIZE + 1];
+	char *value;
+	int origin;						// Local client that sent it, 0 for MQTT
+	int tries;
+	long long deadline;				// msecs, retransmit after it
+	unsigned long order;			// Arrival, pending commands are sent in order
+};
+
+struct command_window {
+	struct command slots[COMMAND_SLOTS];
+	int inflight;
+	unsigned long clock;
+};
+
+int command_add(struct command_window **, char *, int, char *, bool, int, int *, int *);
+struct command *command_next(struct command_window *, int);
+void command_sent(struct command_window *, struct command *, long long);
+struct command *command_find(struct command_window *, int);
+void command_free(struct command_window *, struct command *);
+void command_cleanup(struct command_window **);
+
+#endif
@@ -1,3 +1,4 @@
 #!/bin/bash
-rm -rf mqtt_bridge
-gcc -Wall -lmosquitto mqtt_bridge.c utils.c conf.c device.c arduino-serial-lib.c -o mqtt_bridge
+rm -rf mqtt_bridge shm_bench
+gcc -Wall -lmosquitto mqtt_bridge.c alias.c cbor.c fmt.c serial.c hotplug.c command.c poll.c codec.c registry.c bloom.c journal.c state.c local.c shm.c history.c utils.c conf.c device.c arduino-serial-lib.c arduino-serial-linux.c -o mqtt_bridge
+gcc -Wall -O2 shm_bench.c shm_reader.c -o shm_bench
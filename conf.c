@@ -34,15 +34,27 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "mqtt_bridge.h"
 #include "device.h"
+#include "serial.h"
+#include "command.h"
+#include "poll.h"
+#include "codec.h"
+#include "shm.h"
+#include "local.h"
+#include "history.h"
 
 static int _conf_parse_int(char *token, const char *name, int *value);
 static int _conf_parse_string(char *token, const char *name, char **value);
+static int _conf_parse_policy(char *token, struct bridge_config *config);
+static int _conf_parse_format(char *token, struct bridge_config *config);
+static int _conf_parse_poll_device(char *token, struct bridge_serial *serial);
 
 int config_parse(const char *config_file, struct bridge_config *config)
 {
 	FILE *fptr;
 	char buf[1024];
 	struct bridge_serial *current_serial = NULL;
+	char *end;
+	int type;
 
 	fptr = fopen(config_file, "rt");
 	if(!fptr){
@@ -55,12 +67,40 @@ int config_parse(const char *config_file, struct bridge_config *config)
 	config->mqtt_host = NULL;
 	config->mqtt_port = 1883;
 	config->mqtt_qos = 0;
+	config->mqtt_version = 4;
+	config->mqtt_topic_aliases = 10;
+	config->mqtt_user_props = 0;
+	config->persistent_session = 0;
+	config->state_file = NULL;
+	config->local_socket = NULL;
+	config->local_socket_mode = LOCAL_MODE;
+	config->shm_file = NULL;
+	config->shm_slots = SHM_SLOTS;
+	config->history_file = NULL;
+	config->history_modules = HISTORY_MODULES;
+	config->history_size = HISTORY_SIZE;
+	config->encoding = ENCODING_ASCII;
 	config->serial.port = NULL;
+	config->serial.usb_id = NULL;
+	config->serial.poll_devices = NULL;
+	config->serial.poll_devices_len = 0;
 	config->devices_folder = NULL;
+	config->registry_file = NULL;
+	config->autosave = 0;
+	config->journal_file = NULL;
 	config->scripts_folder = NULL;
 	config->interface = NULL;
 	config->remap_usr1 = NULL;
 	config->remap_usr2 = NULL;
+	config->md_policies = NULL;
+	config->md_policies_len = 0;
+	config->md_formats = NULL;
+	config->md_formats_len = 0;
+	config->batch_publish = 0;
+	config->command_window = COMMAND_WINDOW;
+	config->command_timeout = COMMAND_TIMEOUT;
+	config->command_retries = COMMAND_RETRIES;
+	config->no_coalesce = 0;
 
 	while (fgets(buf, 1024, fptr)) {
 		if (buf[0] != '#' && buf[0] != 10 && buf[0] != 13) {
@@ -110,11 +150,176 @@ int config_parse(const char *config_file, struct bridge_config *config)
 						return 1;
 					}
 				}
+			} else if (!strncmp(buf, "mqtt_version ", 13)) {
+				if (_conf_parse_int(&(buf[13]), "mqtt_version", &config->mqtt_version)) {
+					fclose(fptr);
+					return 1;
+				} else {
+					if (config->mqtt_version < 3 || config->mqtt_version > 5) {
+						fprintf(stderr, "Error: mqtt_version out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				}
+			} else if (!strncmp(buf, "mqtt_topic_aliases ", 19)) {
+				if (_conf_parse_int(&(buf[19]), "mqtt_topic_aliases", &config->mqtt_topic_aliases)) {
+					fclose(fptr);
+					return 1;
+				} else {
+					if (config->mqtt_topic_aliases < 0 || config->mqtt_topic_aliases > 65535) {
+						fprintf(stderr, "Error: mqtt_topic_aliases out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				}
+			} else if (!strncmp(buf, "persistent_session ", 19)) {
+				if (_conf_parse_int(&(buf[19]), "persistent_session", &config->persistent_session)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "local_socket ", 13)) {
+				if (_conf_parse_string(&(buf[13]), "local_socket", &config->local_socket)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "local_socket_mode ", 18)) {
+				config->local_socket_mode = strtol(&buf[18], &end, 8);
+				if (end == &buf[18] || *end || config->local_socket_mode < 0 || config->local_socket_mode > 0777) {
+					fprintf(stderr, "Error: Invalid local_socket_mode in config, octal like 0660.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "shm_file ", 9)) {
+				if (_conf_parse_string(&(buf[9]), "shm_file", &config->shm_file)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "shm_slots ", 10)) {
+				if (_conf_parse_int(&(buf[10]), "shm_slots", &config->shm_slots)) {
+					fclose(fptr);
+					return 1;
+				} else {
+					if (config->shm_slots < 1) {
+						fprintf(stderr, "Error: shm_slots out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				}
+			} else if (!strncmp(buf, "history_file ", 13)) {
+				if (_conf_parse_string(&(buf[13]), "history_file", &config->history_file)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "history_modules ", 16)) {
+				if (_conf_parse_int(&(buf[16]), "history_modules", &config->history_modules)) {
+					fclose(fptr);
+					return 1;
+				} else {
+					if (config->history_modules < 1) {
+						fprintf(stderr, "Error: history_modules out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				}
+			} else if (!strncmp(buf, "history_size ", 13)) {
+				if (_conf_parse_int(&(buf[13]), "history_size", &config->history_size)) {
+					fclose(fptr);
+					return 1;
+				} else {
+					if (config->history_size < HISTORY_BLOCK_SIZE) {
+						fprintf(stderr, "Error: history_size below %d in config.\n", HISTORY_BLOCK_SIZE);
+						fclose(fptr);
+						return 1;
+					}
+				}
+			} else if (!strncmp(buf, "state_file ", 11)) {
+				if (_conf_parse_string(&(buf[11]), "state_file", &config->state_file)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "mqtt_user_props ", 16)) {
+				if (_conf_parse_int(&(buf[16]), "mqtt_user_props", &config->mqtt_user_props)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "encoding ", 9)) {
+				if (!strcmp(&(buf[9]), "ascii")) {
+					config->encoding = ENCODING_ASCII;
+				} else if (!strcmp(&(buf[9]), "cbor")) {
+					config->encoding = ENCODING_CBOR;
+				} else {
+					fprintf(stderr, "Error: Invalid encoding in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "module_qos ", 11)) {
+				if (_conf_parse_policy(&(buf[11]), config)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "module_format ", 14)) {
+				if (_conf_parse_format(&(buf[14]), config)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "batch_publish ", 14)) {
+				if (_conf_parse_int(&(buf[14]), "batch_publish", &config->batch_publish)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "command_window ", 15)) {
+				if (_conf_parse_int(&(buf[15]), "command_window", &config->command_window)) {
+					fclose(fptr);
+					return 1;
+				}
+				if (config->command_window < 1 || config->command_window > COMMAND_SLOTS) {
+					fprintf(stderr, "Error: command_window out of range in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "command_timeout ", 16)) {
+				if (_conf_parse_int(&(buf[16]), "command_timeout", &config->command_timeout)) {
+					fclose(fptr);
+					return 1;
+				}
+				if (config->command_timeout < 1) {
+					fprintf(stderr, "Error: command_timeout out of range in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "command_retries ", 16)) {
+				if (_conf_parse_int(&(buf[16]), "command_retries", &config->command_retries)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "no_coalesce ", 12)) {
+				type = device_md_type(&(buf[12]));
+				if (type == -1) {
+					fprintf(stderr, "Error: Invalid module type in no_coalesce: %s\n", &(buf[12]));
+					fclose(fptr);
+					return 1;
+				}
+				config->no_coalesce |= 1UL << type;
 			} else if (!strncmp(buf, "devices_folder ", 15)) {
 				if (_conf_parse_string(&(buf[15]), "devices_folder", &config->devices_folder)) {
 					fclose(fptr);
 					return 1;
 				}
+			} else if (!strncmp(buf, "autosave ", 9)) {
+				if (_conf_parse_int(&(buf[9]), "autosave", &config->autosave)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "journal_file ", 13)) {
+				if (_conf_parse_string(&(buf[13]), "journal_file", &config->journal_file)) {
+					fclose(fptr);
+					return 1;
+				}
+			} else if (!strncmp(buf, "registry_file ", 14)) {
+				if (_conf_parse_string(&(buf[14]), "registry_file", &config->registry_file)) {
+					fclose(fptr);
+					return 1;
+				}
 			} else if (!strncmp(buf, "scripts_folder ", 15)) {
 				if (_conf_parse_string(&(buf[15]), "scripts_folder", &config->scripts_folder)) {
 					fclose(fptr);
@@ -125,6 +330,14 @@ int config_parse(const char *config_file, struct bridge_config *config)
 				current_serial->baudrate = 9600;
 				current_serial->timeout = 100;
 				current_serial->qos = 0;
+				current_serial->rx_buffer = SERIAL_RX_BUFFER;
+				current_serial->overflow = SERIAL_DROP_NEWEST;
+				current_serial->framing = SERIAL_FRAMING_ASCII;
+				current_serial->low_latency = 0;
+				current_serial->hotplug = 0;
+				current_serial->usb_id = NULL;
+				current_serial->poll = 0;
+				current_serial->poll_timeout = POLL_TIMEOUT;
 
 				if (_conf_parse_string(&(buf[5]), "port", &current_serial->port)) {
 					fclose(fptr);
@@ -136,10 +349,8 @@ int config_parse(const char *config_file, struct bridge_config *config)
 						fclose(fptr);
 						return 1;
 					}
-					if (current_serial->baudrate != 4800 && current_serial->baudrate != 9600
-					&& current_serial->baudrate != 14400 && current_serial->baudrate != 19200
-					&& current_serial->baudrate != 28800 && current_serial->baudrate != 38400
-					&& current_serial->baudrate != 57600 && current_serial->baudrate != 115200) {
+					// Non standard rates are set through termios2
+					if (current_serial->baudrate < 50 || current_serial->baudrate > 4000000) {
 						fprintf(stderr, "Error: invalid baudrate.\n");
 						fclose(fptr);
 						return 1;
@@ -160,6 +371,125 @@ int config_parse(const char *config_file, struct bridge_config *config)
 					fclose(fptr);
 					return 1;
 				}
+			} else if(!strncmp(buf, "rx_buffer ", 10)) {
+				if (current_serial){
+					if (_conf_parse_int(&(buf[10]), "rx_buffer", &current_serial->rx_buffer)) {
+						fclose(fptr);
+						return 1;
+					}
+					if (current_serial->rx_buffer < 1) {
+						fprintf(stderr, "Error: rx_buffer out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: rx_buffer keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "overflow ", 9)) {
+				if (current_serial){
+					if (!strcmp(&(buf[9]), "drop_newest")) {
+						current_serial->overflow = SERIAL_DROP_NEWEST;
+					} else if (!strcmp(&(buf[9]), "drop_oldest")) {
+						current_serial->overflow = SERIAL_DROP_OLDEST;
+					} else {
+						fprintf(stderr, "Error: Invalid overflow in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: overflow keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "low_latency ", 12)) {
+				if (current_serial){
+					if (_conf_parse_int(&(buf[12]), "low_latency", &current_serial->low_latency)) {
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: low_latency keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "hotplug ", 8)) {
+				if (current_serial){
+					if (_conf_parse_int(&(buf[8]), "hotplug", &current_serial->hotplug)) {
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: hotplug keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "usb_id ", 7)) {
+				if (current_serial){
+					if (_conf_parse_string(&(buf[7]), "usb_id", &current_serial->usb_id)) {
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: usb_id keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "poll ", 5)) {
+				if (current_serial){
+					if (_conf_parse_int(&(buf[5]), "poll", &current_serial->poll)) {
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: poll keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "poll_timeout ", 13)) {
+				if (current_serial){
+					if (_conf_parse_int(&(buf[13]), "poll_timeout", &current_serial->poll_timeout)) {
+						fclose(fptr);
+						return 1;
+					}
+					if (current_serial->poll_timeout < 1) {
+						fprintf(stderr, "Error: poll_timeout out of range in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: poll_timeout keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "poll_device ", 12)) {
+				if (current_serial){
+					if (_conf_parse_poll_device(&(buf[12]), current_serial)) {
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: poll_device keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
+			} else if(!strncmp(buf, "framing ", 8)) {
+				if (current_serial){
+					if (!strcmp(&(buf[8]), "ascii")) {
+						current_serial->framing = SERIAL_FRAMING_ASCII;
+					} else if (!strcmp(&(buf[8]), "cobs")) {
+						current_serial->framing = SERIAL_FRAMING_COBS;
+					} else {
+						fprintf(stderr, "Error: Invalid framing in config.\n");
+						fclose(fptr);
+						return 1;
+					}
+				} else {
+					fprintf(stderr, "Error: framing keyword without serial_port in config.\n");
+					fclose(fptr);
+					return 1;
+				}
 			} else if (!strncmp(buf, "interface ", 10)) {
 				if (_conf_parse_string(&(buf[10]), "interface", &config->interface)) {
 					fclose(fptr);
@@ -200,12 +530,28 @@ int config_parse(const char *config_file, struct bridge_config *config)
 
 void config_cleanup(struct bridge_config *config)
 {
+	int i;
+
 	free(config->id);
 	free(config->mqtt_host);
 	if(config->serial.port != NULL)
 		free(config->serial.port);
+	if(config->serial.usb_id != NULL)
+		free(config->serial.usb_id);
 	if (config->devices_folder != NULL)
 		free(config->devices_folder);
+	if (config->registry_file != NULL)
+		free(config->registry_file);
+	if (config->journal_file != NULL)
+		free(config->journal_file);
+	if (config->state_file != NULL)
+		free(config->state_file);
+	if (config->local_socket != NULL)
+		free(config->local_socket);
+	if (config->shm_file != NULL)
+		free(config->shm_file);
+	if (config->history_file != NULL)
+		free(config->history_file);
 	if (config->scripts_folder != NULL)
 		free(config->scripts_folder);
 	if (config->interface != NULL)
@@ -214,6 +560,15 @@ void config_cleanup(struct bridge_config *config)
 		free(config->remap_usr1);
 	if (config->remap_usr2 != NULL)
 		free(config->remap_usr2);
+	for (i = 0; i < config->md_policies_len; i++)
+		free(config->md_policies[i].match);
+	free(config->md_policies);
+	for (i = 0; i < config->md_formats_len; i++)
+		free(config->md_formats[i].match);
+	free(config->md_formats);
+	for (i = 0; i < config->serial.poll_devices_len; i++)
+		free(config->serial.poll_devices[i].id);
+	free(config->serial.poll_devices);
 }
 
 
@@ -229,6 +584,126 @@ static int _conf_parse_int(char *token, const char *name, int *value)
 	return 0;
 }
 
+// module_qos <module id|module type> <qos> [retain]
+static int _conf_parse_policy(char *token, struct bridge_config *config)
+{
+	struct module_policy *policy;
+	char *match, *qos, *retain;
+
+	match = strtok(token, " \t");
+	qos = strtok(NULL, " \t");
+	retain = strtok(NULL, " \t");
+	if (!match || !qos) {
+		fprintf(stderr, "Error: Empty module_qos value in configuration.\n");
+		return 1;
+	}
+	if (strlen(qos) != 1 || qos[0] < '0' || qos[0] > '2') {
+		fprintf(stderr, "Error: module_qos out of range in config.\n");
+		return 1;
+	}
+	if (retain && strcmp(retain, "retain")) {
+		fprintf(stderr, "Error: Invalid module_qos option \"%s\" in config.\n", retain);
+		return 1;
+	}
+
+	policy = realloc(config->md_policies, sizeof(struct module_policy) * (config->md_policies_len + 1));
+	if (!policy) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	config->md_policies = policy;
+	policy = &config->md_policies[config->md_policies_len];
+	policy->match = strdup(match);
+	if (!policy->match) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	policy->qos = qos[0] - '0';
+	policy->retain = retain != NULL;
+	config->md_policies_len++;
+
+	return 0;
+}
+
+// module_format <module id|module type> <raw|plain|json|line> [scale]
+static int _conf_parse_format(char *token, struct bridge_config *config)
+{
+	struct module_format *format;
+	char *match, *name, *scale;
+	int id;
+
+	match = strtok(token, " \t");
+	name = strtok(NULL, " \t");
+	scale = strtok(NULL, " \t");
+	if (!match || !name) {
+		fprintf(stderr, "Error: Empty module_format value in configuration.\n");
+		return 1;
+	}
+	id = codec_format(name);
+	if (id == -1) {
+		fprintf(stderr, "Error: Invalid module_format \"%s\" in config.\n", name);
+		return 1;
+	}
+	if (scale && atof(scale) == 0) {
+		fprintf(stderr, "Error: Invalid module_format scale in config.\n");
+		return 1;
+	}
+
+	format = realloc(config->md_formats, sizeof(struct module_format) * (config->md_formats_len + 1));
+	if (!format) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	config->md_formats = format;
+	format = &config->md_formats[config->md_formats_len];
+	format->match = strdup(match);
+	if (!format->match) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	format->format = id;
+	format->scale = scale ? atof(scale) : 1;
+	config->md_formats_len++;
+
+	return 0;
+}
+
+// poll_device <device id> [interval msecs]
+static int _conf_parse_poll_device(char *token, struct bridge_serial *serial)
+{
+	struct poll_device *node;
+	char *id, *interval;
+
+	id = strtok(token, " \t");
+	interval = strtok(NULL, " \t");
+	if (!id || !device_isValid_id(id)) {
+		fprintf(stderr, "Error: Invalid poll_device id in config.\n");
+		return 1;
+	}
+
+	node = realloc(serial->poll_devices, sizeof(struct poll_device) * (serial->poll_devices_len + 1));
+	if (!node) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	serial->poll_devices = node;
+	node = &serial->poll_devices[serial->poll_devices_len];
+	node->id = strdup(id);
+	if (!node->id) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	node->interval = interval ? atoi(interval) : 0;		// 0 uses the poll interval
+	if (node->interval < 0) {
+		free(node->id);
+		fprintf(stderr, "Error: poll_device interval out of range in config.\n");
+		return 1;
+	}
+	serial->poll_devices_len++;
+
+	return 0;
+}
+
 static int _conf_parse_string(char *token, const char *name, char **value)
 {
 	if (token) {
@@ -25,10 +25,14 @@
 #include "device.h"
 #include "mqtt_bridge.h"
 #include "utils.h"
+#include "serial.h"
+#include "command.h"
+#include "codec.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 const char *modules_name[MODULES_NAME_SIZE] = {"dummy", "temp", "ldr", "hum", "zmon", "acpower", "dcpower", "amps", "volts" 
 	, "watts", "rain", "sonar", "led", "rgb", "lcd16x2", "bts", "btl", "flag1", "flag2", "flag3", "flag4", "flag5", "script"
@@ -45,11 +49,22 @@ int device_init(struct bridge *bdev, char *id)
 	bdev->controller = false;
 	bdev->serial_ready = 0;
 	bdev->serial_alive = 0;
+	bdev->serial_framing = SERIAL_FRAMING_ASCII;
+	bdev->serial_bad_frames = 0;
 	bdev->modules_len = 0;
 	bdev->module = NULL;
 	bdev->devices_len = 0;
 	bdev->devices = NULL;
 	bdev->modules_update = false;
+	bdev->policies = NULL;
+	bdev->policies_len = 0;
+	bdev->formats = NULL;
+	bdev->formats_len = 0;
+	memset(bdev->md_hash, 0, sizeof(bdev->md_hash));
+	memset(bdev->md_disabled, 0, sizeof(bdev->md_disabled));
+	bdev->md_index_len = 0;
+	bdev->md_free = NULL;
+	bdev->md_free_len = 0;
 
 	topic_len = snprintf(NULL, 0, "config/%s", id);
 	if((bdev->config_topic = (char *)malloc((topic_len + 1)* (sizeof(char)))) == NULL) {
@@ -68,19 +83,74 @@ int device_init(struct bridge *bdev, char *id)
 	return 0;
 }
 
+// Module id policies take precedence over module type policies
+static void _device_apply_policy(struct bridge *bdev, struct module *md)
+{
+	struct module_policy *policy = NULL;
+	int i;
+
+	for (i = 0; i < bdev->policies_len; i++) {
+		if (!strcmp(bdev->policies[i].match, md->id)) {
+			policy = &bdev->policies[i];
+			break;
+		}
+		if (!policy && !strcmp(bdev->policies[i].match, modules_name[md->type]))
+			policy = &bdev->policies[i];
+	}
+	if (policy) {
+		md->qos = policy->qos;
+		md->retain = policy->retain;
+	}
+}
+
+// Same precedence as the qos policies, formats only apply to types with a codec
+static void _device_apply_format(struct bridge *bdev, struct module *md)
+{
+	struct module_format *format = NULL;
+	int i;
+
+	md->format = CODEC_RAW;
+	md->scale = 1;
+	if (!codec_get(md->type))
+		return;
+
+	for (i = 0; i < bdev->formats_len; i++) {
+		if (!strcmp(bdev->formats[i].match, md->id)) {
+			format = &bdev->formats[i];
+			break;
+		}
+		if (!format && !strcmp(bdev->formats[i].match, modules_name[md->type]))
+			format = &bdev->formats[i];
+	}
+	if (format) {
+		md->format = format->format;
+		md->scale = format->scale;
+	}
+}
+
+static unsigned int _device_md_hash(const char *md_id)
+{
+	unsigned int hash = 5381;
+	int i;
+
+	for (i = 0; i < DEVICE_MD_ID_SIZE; i++)
+		hash = hash * 33 + md_id[i];
+	return hash & (DEVICE_MD_HASH_SIZE - 1);
+}
+
 int device_add_module(struct bridge *bdev, char *md_id, char *dev_id)
 {
+	struct device *dev;
 	struct module *md;
+	unsigned int bucket;
 
 	if (!device_isValid_md_id(md_id))
 		return 1;
 	if (!device_isValid_id(dev_id))
 		return 1;
 
-	for (md = bdev->module; md != NULL; md = md->next) {
-		if (!strcmp(md->id, md_id))
-			return 1;
-	}
+	if (device_get_module(bdev, md_id))
+		return 1;
 
 	if ((md = malloc(sizeof(struct module))) == NULL) {
 		fprintf(stderr, "No memory left.\n");
@@ -91,6 +161,16 @@ int device_add_module(struct bridge *bdev, char *md_id, char *dev_id)
 	md->next = bdev->module;
 	bdev->module = md;
 
+	// Tables indexed by module stay as small as the modules alive at once
+	if (bdev->md_free_len)
+		md->index = bdev->md_free[--bdev->md_free_len];
+	else
+		md->index = bdev->md_index_len++;
+
+	bucket = _device_md_hash(md_id);
+	md->hnext = bdev->md_hash[bucket];
+	bdev->md_hash[bucket] = md;
+
 	md->id = strdup(md_id);
 	if (!md->id) {
 		fprintf(stderr, "Error: No memory left.\n");
@@ -104,8 +184,23 @@ int device_add_module(struct bridge *bdev, char *md_id, char *dev_id)
 	md->enabled = true;
 	md->type = (((md_id[0] - 48) * 100) + ((md_id[1] - 48) * 10) + (md_id[2] - 48));
 	md->topic = NULL;
+	md->qos = MODULE_QOS_DEFAULT;
+	md->retain = false;
+	md->value = NULL;
+	md->value_size = 0;
+	md->updated = 0;
+	_device_apply_policy(bdev, md);
+	_device_apply_format(bdev, md);
 	bdev->modules_update = true;
 
+	dev = device_get(bdev, dev_id);
+	if (dev) {
+		md->dnext = dev->md_list;
+		dev->md_list = md;
+	} else {
+		md->dnext = NULL;
+	}
+
 	return device_set_md_default_topic(md, bdev->id);
 }
 
@@ -151,6 +246,87 @@ int device_set_md_topic(struct module *module, char *topic)
 	return 0;
 }
 
+int device_set_md_qos(struct module *module, int qos, bool retain)
+{
+	if (qos < MODULE_QOS_DEFAULT || qos > 2)
+		return 1;
+
+	if (module->qos == qos && module->retain == retain)
+		return 1;
+
+	module->qos = qos;
+	module->retain = retain;
+
+	return 0;
+}
+
+// The buffer is reused and only grows, so steady updates do not allocate
+int device_set_md_value(struct module *module, char *value)
+{
+	char *new_value;
+	int len;
+
+	len = strlen(value) + 1;
+	if (len > module->value_size) {
+		if ((new_value = realloc(module->value, len)) == NULL) {
+			fprintf(stderr, "Error: No memory left.\n");
+			return -1;
+		}
+		module->value = new_value;
+		module->value_size = len;
+	}
+	memcpy(module->value, value, len);
+	module->updated = time(NULL);
+
+	return 0;
+}
+
+// Sets the bucket bit while any module of the bucket is disabled
+static void _device_md_mark(struct bridge *bdev, unsigned int bucket)
+{
+	struct module *md;
+
+	for (md = bdev->md_hash[bucket]; md != NULL; md = md->hnext) {
+		if (!md->enabled) {
+			bdev->md_disabled[bucket / 8] |= 1 << (bucket % 8);
+			return;
+		}
+	}
+	bdev->md_disabled[bucket / 8] &= ~(1 << (bucket % 8));
+}
+
+// Returns 1 if the module was already in that state
+int device_set_md_enabled(struct bridge *bdev, struct module *module, bool enabled)
+{
+	if (module->enabled == enabled)
+		return 1;
+
+	module->enabled = enabled;
+	_device_md_mark(bdev, _device_md_hash(module->id));
+
+	return 0;
+}
+
+// Unknown modules are reported as enabled, they are handled further down.
+// Only buckets holding a disabled module are searched.
+bool device_md_enabled(struct bridge *bdev, char *md_id)
+{
+	struct module *md;
+	unsigned int bucket;
+
+	if (!device_isValid_md_id(md_id))
+		return true;
+	bucket = _device_md_hash(md_id);
+	if (!(bdev->md_disabled[bucket / 8] & (1 << (bucket % 8))))
+		return true;
+
+	for (md = bdev->md_hash[bucket]; md != NULL; md = md->hnext) {
+		if (!strcmp(md->id, md_id))
+			return md->enabled;
+	}
+	return true;
+}
+
 struct module* device_get_module(struct bridge *bdev, char *md_id)
 {
 	struct module *md;
@@ -158,7 +334,7 @@ struct module* device_get_module(struct bridge *bdev, char *md_id)
 	if (!device_isValid_md_id(md_id))
 		return NULL;
 
-	for (md = bdev->module; md != NULL; md = md->next) {
+	for (md = bdev->md_hash[_device_md_hash(md_id)]; md != NULL; md = md->hnext) {
 		if (!strcmp(md->id, md_id))
 				return md;
 	}
@@ -167,7 +343,9 @@ struct module* device_get_module(struct bridge *bdev, char *md_id)
 
 int device_remove_module(struct bridge *bdev, char *md_id)
 {
-	struct module *prev_md, *md;
+	struct module *prev_md, *md, **hash_md;
+	struct device *dev;
+	int *md_free;
 
 	if (!device_isValid_md_id(md_id))
 		return 1;
@@ -178,11 +356,36 @@ int device_remove_module(struct bridge *bdev, char *md_id)
 			continue;
 		}
 
-		prev_md->next = md->next;
+		md_free = realloc(bdev->md_free, (bdev->md_free_len + 1) * sizeof(int));
+		if (!md_free) {
+			fprintf(stderr, "Error: No memory left.\n");
+			return -1;
+		}
+		bdev->md_free = md_free;
+		bdev->md_free[bdev->md_free_len++] = md->index;
+
+		if (md == bdev->module)
+			bdev->module = md->next;
+		else
+			prev_md->next = md->next;
+		hash_md = &bdev->md_hash[_device_md_hash(md_id)];
+		while (*hash_md != md)
+			hash_md = &(*hash_md)->hnext;
+		*hash_md = md->hnext;
+		dev = device_get(bdev, md->device);
+		if (dev) {
+			hash_md = &dev->md_list;
+			while (*hash_md != md)
+				hash_md = &(*hash_md)->dnext;
+			*hash_md = md->dnext;
+		}
+		if (!md->enabled)
+			_device_md_mark(bdev, _device_md_hash(md_id));
 		bdev->modules_len--;
 		free(md->id);
 		free(md->device);
 		free(md->topic);
+		free(md->value);
 		free(md);
 		return 0;
 	}
@@ -191,8 +394,8 @@ int device_remove_module(struct bridge *bdev, char *md_id)
 
 void device_print_module(struct module *md)
 {
-	printf("       id: %s\n       type: %s\n       enabled: %d\n       device: %s\n       topic: %s\n",
-			md->id, modules_name[md->type], md->enabled, md->device, md->topic);
+	printf("       id: %s\n       type: %s\n       enabled: %d\n       device: %s\n       topic: %s\n       qos: %d\n       retain: %d\n",
+			md->id, modules_name[md->type], md->enabled, md->device, md->topic, md->qos, md->retain);
 }
 
 void device_print_modules(struct bridge *bdev)
@@ -243,6 +446,18 @@ int device_add_dev(struct bridge *bdev, char *id, char *md_id)
 	current->alive = ALIVE_CNT;
 	current->type = id[0] - 48;
 	current->modules = 0;
+	current->commands = NULL;
+	current->dirty = false;
+	current->stored = false;
+
+	// Modules can outlive their device, get them back
+	current->md_list = NULL;
+	for (md = bdev->module; md != NULL; md = md->next) {
+		if (!strcmp(md->device, id)) {
+			md->dnext = current->md_list;
+			current->md_list = md;
+		}
+	}
 
 	if (!strcmp(md_id, MODULE_MQTT_ID)) {
 		i = snprintf(NULL, 0, "config/%s", id);
@@ -284,6 +499,7 @@ int device_remove_dev(struct bridge *bdev, char *id)
 		free(current->md_deps);
 		if (current->topic)
 			free(current->topic);
+		command_cleanup(&current->commands);
 
 		free(bdev->devices);
 		bdev->devices = new_devices;
@@ -336,6 +552,18 @@ int device_isValid_id(char *id)
 	return 1;
 }
 
+// Module type from its name, -1 if unknown
+int device_md_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < MODULES_NAME_SIZE; i++) {
+		if (!strcmp(modules_name[i], name))
+			return i;
+	}
+	return -1;
+}
+
 int device_isValid_md_id(char *md_id)
 {
 	int type;
@@ -368,53 +596,150 @@ void device_print_devices(struct bridge *bdev)
 	}
 }
 
+// Module line of the device file format, without the line end.
+// qos and retain are left out when at the defaults, so a module_qos policy
+// added later applies, unless explicit asks for them (journal and state).
+int device_md_line(struct module *md, char *buf, int size, bool explicit)
+{
+	if (!explicit && md->qos == MODULE_QOS_DEFAULT && !md->retain)
+		return snprintf(buf, size, "module,%s,%s,%d", md->id, md->topic, md->enabled);
+	return snprintf(buf, size, "module,%s,%s,%d,%d,%d", md->id, md->topic, md->enabled, md->qos, md->retain);
+}
+
+// Write the device and its modules in the device file format
+void device_write(struct bridge *bdev, FILE *fptr, struct device *dev, bool explicit)
+{
+	char line[TOPIC_MAX_SIZE + 32];
+	struct module *md;
+
+	fprintf(fptr, "device,%s,%s\n", dev->id, dev->md_deps->id);
+	for (md = dev->md_list; md != NULL; md = md->dnext) {
+		device_md_line(md, line, sizeof(line), explicit);
+		fprintf(fptr, "%s\n", line);
+	}
+}
+
+// Written to "<id>.tmp" first and renamed, a crash leaves the old file
 int device_save(struct bridge *bdev, char *folder, struct device *dev)
 {
 	FILE *fptr;
-	char *dev_file;
-	struct module *md;
-	const int line_size = 100;
-	char line[line_size + 1];
-	int len;
+	char *dev_file, *tmp_file;
+	int len, return_val = 0;
 
-	len = strlen(folder) + DEVICE_ID_SIZE + 2;
+	len = strlen(folder) + DEVICE_ID_SIZE + 6;
 	if((dev_file = (char *)malloc((len + 1)* (sizeof(char)))) == NULL) {
 		fprintf(stderr, "No memory left.\n");
 		return -1;
 	}
+	if((tmp_file = (char *)malloc((len + 1)* (sizeof(char)))) == NULL) {
+		fprintf(stderr, "No memory left.\n");
+		free(dev_file);
+		return -1;
+	}
 	snprintf(dev_file, len + 1, "%s/%s", folder, dev->id);
+	snprintf(tmp_file, len + 1, "%s/%s.tmp", folder, dev->id);
 
-	fptr = fopen(dev_file, "w");
+	fptr = fopen(tmp_file, "w");
 	if(!fptr){
-		fprintf(stderr, "Error opening device file for write \"%s\".\n", dev_file);
+		fprintf(stderr, "Error opening device file for write \"%s\".\n", tmp_file);
 		free(dev_file);
+		free(tmp_file);
 		return 1;
 	}
 
-	snprintf(line, line_size, "device,%s,%s\n", dev->id, dev->md_deps->id);
-	fputs(line, fptr);
-	for (md = bdev->module; md != NULL; md = md->next) {
-		if (!strcmp(md->device, dev->id)) {
-			snprintf(line, line_size, "module,%s,%s,%d\n", md->id, md->topic, md->enabled);
-			fputs(line, fptr);
-		}
+	device_write(bdev, fptr, dev, false);
+	if (fflush(fptr) || fsync(fileno(fptr)) || ferror(fptr)) {
+		fprintf(stderr, "Error writing device file \"%s\".\n", tmp_file);
+		return_val = 1;
 	}
 	fclose(fptr);
+	if (!return_val && rename(tmp_file, dev_file) == -1) {
+		fprintf(stderr, "Error replacing device file \"%s\".\n", dev_file);
+		unlink(tmp_file);
+		return_val = 1;
+	} else if (return_val) {
+		unlink(tmp_file);
+	} else if (sync_dir(dev_file) == -1) {
+		fprintf(stderr, "Error syncing device folder \"%s\".\n", folder);
+		return_val = 1;				// Stays dirty, saved again later
+	} else {
+		dev->dirty = false;
+	}
 
 	free(dev_file);
-	return 0;
+	free(tmp_file);
+	return return_val;
 }
 
-int device_load(struct bridge *bdev, char *folder, char *dev_id)
+// Parse one line of a device file, comments and empty lines are skipped.
+// Returns 1 if the line is invalid.
+int device_load_line(struct bridge *bdev, char *dev_id, char *buf)
 {
-	FILE *fptr;
-	char buf[1024];
 	char *bufptr;
 	char new_devId[DEVICE_ID_SIZE + 1];
 	char md_id[DEVICE_MD_ID_SIZE + 1];
 	char topic[TOPIC_MAX_SIZE + 1];
+	char qos_field[3];
 	struct module *md;
-	int enabled;
+	int enabled, qos, retain, has_qos;
+
+	if (buf[0] == '#' || buf[0] == 10 || buf[0] == 13 || buf[0] == 0)
+		return 0;
+	while (buf[strlen(buf)-1] == 10 || buf[strlen(buf)-1] == 13) {
+		buf[strlen(buf)-1] = 0;
+	}
+
+	if (!strncmp(buf, "device,", 7)) {
+		bufptr = &buf[7];
+		if (getString(&bufptr, new_devId, DEVICE_ID_SIZE, ',') != DEVICE_ID_SIZE)
+			return 1;
+		if (strcmp(dev_id, new_devId))
+			return 1;
+		if (getString(&bufptr, md_id, DEVICE_MD_ID_SIZE, ',') != DEVICE_MD_ID_SIZE)
+			return 1;
+		if (device_add_dev(bdev, dev_id, md_id) == -1)
+			return -1;
+	}
+	else if (!strncmp(buf, "module,", 7)) {
+		bufptr = &buf[7];
+		if (getString(&bufptr, md_id, DEVICE_MD_ID_SIZE, ',') != DEVICE_MD_ID_SIZE)
+			return 1;
+		if (getString(&bufptr, topic, TOPIC_MAX_SIZE, ',') < TOPIC_MIN_SIZE)
+			return 1;
+		if (!getInt(&bufptr, &enabled))
+			return 1;
+		// Optional qos and retain, absent when left to the defaults or policy
+		qos = MODULE_QOS_DEFAULT;
+		retain = 0;
+		has_qos = getString(&bufptr, qos_field, 2, ',');
+		if (has_qos) {
+			qos = atoi(qos_field);
+			if (!getInt(&bufptr, &retain))
+				return 1;
+		}
+		if (device_add_module(bdev, md_id, dev_id) == -1)
+			return -1;
+		// The module may be loaded already when replaying the journal,
+		// or refused for a type this bridge doesn't know
+		md = device_get_module(bdev, md_id);
+		if (!md)
+			return 1;
+		device_set_md_enabled(bdev, md, enabled);
+		// Left to the module_qos policy unless recorded
+		if (has_qos)
+			device_set_md_qos(md, qos, retain);
+		if (strcmp(topic, md->topic)) {
+			if (device_set_md_topic(md, topic) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+int device_load(struct bridge *bdev, char *folder, char *dev_id)
+{
+	FILE *fptr;
+	char buf[1024];
 	char *dev_file;
 	int len, return_val = 0;
 
@@ -432,64 +757,11 @@ int device_load(struct bridge *bdev, char *folder, char *dev_id)
 	}
 
 	while (fgets(buf, 1024, fptr)) {
-		if (buf[0] != '#' && buf[0] != 10 && buf[0] != 13) {
-			while (buf[strlen(buf)-1] == 10 || buf[strlen(buf)-1] == 13) {
-				buf[strlen(buf)-1] = 0;
-			}
-			if (!strncmp(buf, "device,", 7)) {
-				bufptr = &buf[7];
-				if (getString(&bufptr, new_devId, DEVICE_ID_SIZE, ',') != DEVICE_ID_SIZE) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (strcmp(dev_id, new_devId)) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (getString(&bufptr, md_id, DEVICE_MD_ID_SIZE, ',') != DEVICE_MD_ID_SIZE) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (device_add_dev(bdev, dev_id, md_id) == -1) {
-					return_val = -1;
-					break;
-				}
-			}
-			else if (!strncmp(buf, "module,", 7)) {
-				bufptr = &buf[7];
-				if (getString(&bufptr, md_id, DEVICE_MD_ID_SIZE, ',') != DEVICE_MD_ID_SIZE) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (getString(&bufptr, topic, TOPIC_MAX_SIZE, ',') < TOPIC_MIN_SIZE) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (!getInt(&bufptr, &enabled)) {
-					fprintf(stderr, "Invalid device file: %s\n", dev_id);
-					return_val = 1;
-					break;
-				}
-				if (device_add_module(bdev, md_id, dev_id) == -1) {
-					return_val = -1;
-					break;
-				}
-				md = device_get_module(bdev, md_id);
-				if (!enabled)
-					md->enabled = 0;
-				if (strcmp(topic, md->topic)) {
-					if (device_set_md_topic(md, topic) == -1) {
-						return_val = -1;
-						break;
-					}
-				}
-			}
-		}
+		return_val = device_load_line(bdev, dev_id, buf);
+		if (return_val == 1)
+			fprintf(stderr, "Invalid device file: %s\n", dev_id);
+		if (return_val)
+			break;
 	}
 	fclose(fptr);
 
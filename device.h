@@ -26,12 +26,17 @@
 #define DEVICE_H
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 
 #define DEVICE_VERSION "1.01"
 
 #define DEVICE_ID_SIZE 9
 #define DEVICE_MD_ID_SIZE 7
 
+#define MODULE_QOS_DEFAULT -1			// Use mqtt_qos from config
+#define DEVICE_MD_HASH_SIZE 64			// Module lookup buckets, a power of two
+
 #define DEVICE_TYPE_NODE 0
 #define DEVICE_TYPE_BRIDGE 1
 #define DEVICE_TYPE_CONTROLLER 2
@@ -75,11 +80,15 @@
 #define MODULE_SIGUSR1_ID "026FFA1"
 #define MODULE_SIGUSR2_ID "027FFA1"
 
+extern const char *modules_name[MODULES_NAME_SIZE];
+
 struct bridge {
 	char *id;
 	bool controller;
 	bool serial_ready;
 	int serial_alive;
+	int serial_framing;
+	int serial_bad_frames;			// Invalid COBS frames in a row
 	int modules_len;
 	struct module *module;
 	int devices_len;
@@ -87,8 +96,19 @@ struct bridge {
 	bool modules_update;
 	char *config_topic;
 	char *status_topic;
+	struct module_policy *policies;
+	int policies_len;
+	struct module_format *formats;
+	int formats_len;
+	struct module *md_hash[DEVICE_MD_HASH_SIZE];
+	unsigned char md_disabled[DEVICE_MD_HASH_SIZE / 8];	// Buckets holding a disabled module
+	int md_index_len;
+	int *md_free;					// Indexes of removed modules, reused first
+	int md_free_len;
 };
 
+struct command_window;
+
 struct device {
 	char *id;
 	int type;
@@ -96,6 +116,10 @@ struct device {
 	struct module *md_deps;
 	int modules;
 	char *topic;
+	struct command_window *commands;	// Sequenced commands, NULL until first used
+	struct module *md_list;			// Modules of the device, linked by dnext
+	bool dirty;						// Changed since it was saved
+	bool stored;					// Saved or journaled, replay can find it
 };
 
 struct module {
@@ -104,6 +128,16 @@ struct module {
 	bool enabled;
 	char *device;
 	char *topic;
+	int qos;
+	bool retain;
+	int format;						// Output of the readings, see codec.h
+	double scale;
+	char *value;					// Last known value
+	int value_size;
+	time_t updated;
+	int index;						// Slot of the module in the shm and history tables
+	struct module *hnext;			// Next in the hash bucket
+	struct module *dnext;			// Next module of the same device
 	struct module *next;
 };
 
@@ -111,6 +145,10 @@ int device_init(struct bridge *, char *);
 int device_add_module(struct bridge *, char *, char *);
 int device_set_md_default_topic(struct module *, char *);
 int device_set_md_topic(struct module *, char *);
+int device_set_md_qos(struct module *, int, bool);
+int device_set_md_value(struct module *, char *);
+int device_set_md_enabled(struct bridge *, struct module *, bool);
+bool device_md_enabled(struct bridge *, char *);
 struct module *device_get_module(struct bridge *, char *);
 int device_remove_module(struct bridge *, char *);
 void device_print_module(struct module *);
@@ -120,9 +158,13 @@ struct device *device_get(struct bridge *, char *);
 struct device *device_get_by_deps(struct bridge *, char *);
 int device_isValid_id(char *);
 int device_isValid_md_id(char *);
+int device_md_type(const char *);
 void device_print_device(struct device *);
 void device_print_devices(struct bridge *);
+int device_md_line(struct module *, char *, int, bool);
+void device_write(struct bridge *, FILE *, struct device *, bool);
 int device_save(struct bridge *, char *, struct device *);
+int device_load_line(struct bridge *, char *, char *);
 int device_load(struct bridge *, char *, char *);
 
 #endif
\ No newline at end of file
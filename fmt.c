@@ -0,0 +1,161 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "fmt.h"
+
+#include <math.h>
+#include <string.h>
+
+// String builder used instead of snprintf on the message path.
+// Appends never write past the buffer, an overflow only sets the error flag.
+
+void fmt_init(struct fmt *f, char *buf, int size)
+{
+	f->buf = buf;
+	f->size = size;
+	f->len = 0;
+	f->error = false;
+}
+
+void fmt_mem(struct fmt *f, const char *mem, int len)
+{
+	if (f->error || f->len + len >= f->size) {
+		f->error = true;
+		return;
+	}
+	memcpy(&f->buf[f->len], mem, len);
+	f->len += len;
+}
+
+void fmt_str(struct fmt *f, const char *str)
+{
+	if (!str)
+		str = "(null)";
+	fmt_mem(f, str, strlen(str));
+}
+
+void fmt_char(struct fmt *f, char ch)
+{
+	if (f->error || f->len + 1 >= f->size) {
+		f->error = true;
+		return;
+	}
+	f->buf[f->len++] = ch;
+}
+
+static void _fmt_uint(struct fmt *f, unsigned long long value, int min_digits)
+{
+	char digits[20];
+	int i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + (value % 10);
+		value /= 10;
+		min_digits--;
+	} while (value || min_digits > 0);
+
+	fmt_mem(f, &digits[i], sizeof(digits) - i);
+}
+
+void fmt_int(struct fmt *f, long long value)
+{
+	if (value < 0) {
+		fmt_char(f, '-');
+		_fmt_uint(f, -(unsigned long long)value, 1);
+	} else {
+		_fmt_uint(f, value, 1);
+	}
+}
+
+// Like "%.<decimals>f" for values that fit in 64 bits once scaled,
+// except that halves are rounded away from zero and -0 is printed as 0
+void fmt_fixed(struct fmt *f, double value, int decimals)
+{
+	unsigned long long scale = 1, scaled;
+	int i;
+
+	for (i = 0; i < decimals; i++)
+		scale *= 10;
+
+	if (value != value || value >= 1e18 / scale || value <= -1e18 / scale) {
+		f->error = true;
+		return;
+	}
+
+	if (value < 0) {
+		value = -value;
+		scaled = value * scale + 0.5;
+		if (scaled)
+			fmt_char(f, '-');
+	} else {
+		scaled = value * scale + 0.5;
+	}
+
+	_fmt_uint(f, scaled / scale, 1);
+	if (decimals > 0) {
+		fmt_char(f, '.');
+		_fmt_uint(f, scaled % scale, decimals);
+	}
+}
+
+// Fewest decimals that give back value, up to FMT_DECIMALS, so numbers
+// parsed from a decimal reading print as they came. Values too large for
+// fmt_fixed() are printed as "<mantissa>e<exponent>".
+void fmt_number(struct fmt *f, double value)
+{
+	double scale = 1, scaled, diff;
+	int decimals, exponent;
+
+	if (!isfinite(value)) {
+		f->error = true;
+		return;
+	}
+	if (value >= 1e18 || value <= -1e18) {
+		for (exponent = 0; (value < 0 ? -value : value) >= scale * 10; exponent++)
+			scale *= 10;
+		fmt_number(f, value / scale);
+		fmt_char(f, 'e');
+		fmt_int(f, exponent);
+		return;
+	}
+
+	for (decimals = 0; decimals < FMT_DECIMALS; decimals++, scale *= 10) {
+		scaled = (value < 0 ? -value : value) * scale;
+		if (scaled >= 1e18)
+			break;
+		diff = scaled - (double)(unsigned long long)(scaled + 0.5);
+		if (diff < 1e-6 && diff > -1e-6)
+			break;
+	}
+	fmt_fixed(f, value, decimals);
+}
+
+// Terminates the string, returns its length or -1 if it did not fit
+int fmt_end(struct fmt *f)
+{
+	if (f->error)
+		return -1;
+	f->buf[f->len] = 0;
+	return f->len;
+}
@@ -0,0 +1,48 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef FMT_H
+#define FMT_H
+
+#include <stdbool.h>
+
+#define FMT_DECIMALS 6					// Most decimals fmt_number() prints
+
+struct fmt {
+	char *buf;
+	int size;						// Buffer size, including the terminator
+	int len;
+	bool error;
+};
+
+void fmt_init(struct fmt *, char *, int);
+void fmt_mem(struct fmt *, const char *, int);
+void fmt_str(struct fmt *, const char *);
+void fmt_char(struct fmt *, char);
+void fmt_int(struct fmt *, long long);
+void fmt_fixed(struct fmt *, double, int);
+void fmt_number(struct fmt *, double);
+int fmt_end(struct fmt *);
+
+#endif
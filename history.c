@@ -0,0 +1,456 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "history.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "device.h"
+
+#define HISTORY_BLOCK_BITS ((HISTORY_BLOCK_SIZE - (int)sizeof(struct history_block)) * 8)
+
+struct history_bits {
+	const uint8_t *data;
+	int pos;
+	int end;
+};
+
+static long long _history_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct history_segment *_history_segment(struct history *hist, int i)
+{
+	return (struct history_segment *)((char *)(hist->header + 1) + i * hist->segment_size);
+}
+
+static struct history_block *_history_block(struct history_segment *seg, int i)
+{
+	return (struct history_block *)((char *)(seg + 1) + i * HISTORY_BLOCK_SIZE);
+}
+
+static void _history_put(struct history_block *block, uint64_t value, int len)
+{
+	while (len--) {
+		if ((value >> len) & 1)
+			block->data[block->bits >> 3] |= 0x80 >> (block->bits & 7);
+		block->bits++;
+	}
+}
+
+// Returns 0 past the end of the data, the caller checks pos
+static uint64_t _history_get(struct history_bits *bits, int len)
+{
+	uint64_t value = 0;
+
+	while (len--) {
+		value <<= 1;
+		if (bits->pos < bits->end && bits->data[bits->pos >> 3] & (0x80 >> (bits->pos & 7)))
+			value |= 1;
+		bits->pos++;
+	}
+	return value;
+}
+
+static void _history_encode(struct history_block *block, long long ts, uint64_t value)
+{
+	long long delta, dod;
+	uint64_t xor;
+	int leading, trailing;
+
+	if (!block->count) {
+		block->first = block->last = ts;
+		block->first_value = block->value = value;
+		block->delta = 0;
+		block->leading = 0xFF;
+		block->trailing = 0;
+		block->count = 1;
+		return;
+	}
+
+	delta = ts - block->last;
+	dod = delta - block->delta;
+	if (!dod) {
+		_history_put(block, 0, 1);
+	} else if (dod >= -63 && dod <= 64) {
+		_history_put(block, 2, 2);
+		_history_put(block, dod + 63, 7);
+	} else if (dod >= -255 && dod <= 256) {
+		_history_put(block, 6, 3);
+		_history_put(block, dod + 255, 9);
+	} else if (dod >= -2047 && dod <= 2048) {
+		_history_put(block, 14, 4);
+		_history_put(block, dod + 2047, 12);
+	} else {
+		_history_put(block, 15, 4);
+		_history_put(block, (uint32_t)dod, 32);
+	}
+
+	xor = value ^ block->value;
+	if (!xor) {
+		_history_put(block, 0, 1);
+	} else {
+		leading = __builtin_clzll(xor);
+		trailing = __builtin_ctzll(xor);
+		if (leading > 31)
+			leading = 31;
+		if (block->leading != 0xFF && leading >= block->leading && trailing >= block->trailing) {
+			// Fits in the window of the previous value
+			_history_put(block, 2, 2);
+			_history_put(block, xor >> block->trailing, 64 - block->leading - block->trailing);
+		} else {
+			_history_put(block, 3, 2);
+			_history_put(block, leading, 5);
+			_history_put(block, 64 - leading - trailing - 1, 6);
+			_history_put(block, xor >> trailing, 64 - leading - trailing);
+			block->leading = leading;
+			block->trailing = trailing;
+		}
+	}
+
+	block->last = ts;
+	block->delta = delta;
+	block->value = value;
+	block->count++;
+}
+
+// Returns 1 once cb asked to stop
+static int _history_decode(struct history_block *block, long long from, long long to, history_point cb, void *arg, int *points)
+{
+	struct history_bits bits;
+	long long ts, delta = 0;
+	uint64_t value;
+	int leading = 0, trailing = 0, len, i;
+	double number;
+
+	bits.data = block->data;
+	bits.pos = 0;
+	bits.end = block->bits;
+	ts = block->first;
+	value = block->first_value;
+
+	for (i = 0; i < block->count; i++) {
+		if (i) {
+			if (_history_get(&bits, 1)) {
+				if (!_history_get(&bits, 1))
+					delta += (long long)_history_get(&bits, 7) - 63;
+				else if (!_history_get(&bits, 1))
+					delta += (long long)_history_get(&bits, 9) - 255;
+				else if (!_history_get(&bits, 1))
+					delta += (long long)_history_get(&bits, 12) - 2047;
+				else
+					delta += (int32_t)_history_get(&bits, 32);
+			}
+			ts += delta;
+
+			if (_history_get(&bits, 1)) {
+				if (_history_get(&bits, 1)) {
+					leading = _history_get(&bits, 5);
+					len = _history_get(&bits, 6) + 1;
+					trailing = 64 - leading - len;
+				} else {
+					len = 64 - leading - trailing;
+				}
+				value ^= _history_get(&bits, len) << trailing;
+			}
+			if (bits.pos > bits.end)
+				return 0;
+		}
+		if (ts < from)
+			continue;
+		if (ts > to)
+			return 0;
+		memcpy(&number, &value, sizeof(number));
+		(*points)++;
+		if (cb(arg, ts, number))
+			return 1;
+	}
+	return 0;
+}
+
+void history_init(struct history *hist)
+{
+	hist->header = NULL;
+	hist->size = 0;
+	hist->segment_size = 0;
+	hist->by_index = NULL;
+	hist->by_index_len = 0;
+	hist->points = 0;
+	hist->blocks = 0;
+	hist->not_numeric = 0;
+	hist->no_room = 0;
+	hist->evicted = 0;
+}
+
+// A file made with other sizes is started over
+int history_open(struct history *hist, const char *path, int segments, int size)
+{
+	struct history_header *header;
+	struct history_segment *seg;
+	struct history_block *block;
+	struct stat st;
+	int fd, blocks, i, j;
+
+	blocks = size / HISTORY_BLOCK_SIZE;
+	hist->segment_size = sizeof(struct history_segment) + (size_t)blocks * HISTORY_BLOCK_SIZE;
+	hist->size = sizeof(struct history_header) + segments * hist->segment_size;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error: Can't open history_file \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Error: Can't open history_file \"%s\": %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	if ((size_t)st.st_size != hist->size && (ftruncate(fd, 0) == -1 || ftruncate(fd, hist->size) == -1)) {
+		fprintf(stderr, "Error: Can't size history_file \"%s\": %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	header = mmap(NULL, hist->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		fprintf(stderr, "Error: Can't map history_file \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	hist->header = header;
+
+	if (header->magic != HISTORY_MAGIC || header->version != HISTORY_VERSION || header->segments != (uint32_t)segments
+			|| header->blocks != (uint32_t)blocks || header->block_size != HISTORY_BLOCK_SIZE) {
+		if (header->magic)
+			fprintf(stderr, "History layout changed, starting over: %s\n", path);
+		memset(header, 0, hist->size);
+		header->version = HISTORY_VERSION;
+		header->segments = segments;
+		header->blocks = blocks;
+		header->block_size = HISTORY_BLOCK_SIZE;
+		header->magic = HISTORY_MAGIC;
+		return 0;
+	}
+
+	// Blocks cut by a crash
+	for (i = 0; i < segments; i++) {
+		seg = _history_segment(hist, i);
+		if (seg->head >= (uint32_t)blocks)
+			seg->head = 0;
+		for (j = 0; j < blocks; j++) {
+			block = _history_block(seg, j);
+			if (block->count && (block->bits > HISTORY_BLOCK_BITS || block->last < block->first))
+				memset(block, 0, HISTORY_BLOCK_SIZE);
+		}
+	}
+
+	return 0;
+}
+
+// Returns the segment of the module, claiming one the first time. Once all
+// are claimed, the segment whose newest reading is the oldest is taken over,
+// so modules that are gone don't keep theirs forever.
+// -2 if there are no segments, -1 if there is no memory.
+static int _history_find(struct history *hist, struct module *md)
+{
+	struct history_segment *seg;
+	int64_t last, oldest_last = 0;
+	int *by_index;
+	int i, j, unused = -1, oldest = -1;
+
+	if (md->index >= hist->by_index_len) {
+		by_index = realloc(hist->by_index, (md->index + 32) * sizeof(int));
+		if (!by_index) {
+			fprintf(stderr, "Error: No memory left.\n");
+			return -1;
+		}
+		for (i = hist->by_index_len; i < md->index + 32; i++)
+			by_index[i] = -1;
+		hist->by_index = by_index;
+		hist->by_index_len = md->index + 32;
+	}
+	if (hist->by_index[md->index] != -1)
+		return hist->by_index[md->index];
+
+	for (i = 0; i < (int)hist->header->segments; i++) {
+		seg = _history_segment(hist, i);
+		if (!strncmp(seg->id, md->id, sizeof(seg->id)))
+			break;
+		if (!seg->id[0]) {
+			if (unused == -1)
+				unused = i;
+			continue;
+		}
+		last = _history_block(seg, seg->head)->last;
+		if (oldest == -1 || last < oldest_last) {
+			oldest = i;
+			oldest_last = last;
+		}
+	}
+	if (i == (int)hist->header->segments) {
+		i = unused;
+		if (i == -1 && oldest != -1) {
+			i = oldest;
+			for (j = 0; j < hist->by_index_len; j++) {
+				if (hist->by_index[j] == i)
+					hist->by_index[j] = -1;
+			}
+			hist->evicted++;
+		}
+		if (i == -1) {
+			i = -2;
+		} else {
+			seg = _history_segment(hist, i);
+			memset(seg, 0, hist->segment_size);
+			strncpy(seg->id, md->id, sizeof(seg->id) - 1);
+		}
+	}
+	hist->by_index[md->index] = i;
+
+	return i;
+}
+
+// The index of a removed module is given to the next new one
+void history_forget(struct history *hist, struct module *md)
+{
+	if (md->index < hist->by_index_len)
+		hist->by_index[md->index] = -1;
+}
+
+// Keep the last value of the module, if it is a number.
+// Returns 1 if it was not kept.
+int history_add(struct history *hist, struct module *md)
+{
+	struct history_segment *seg;
+	struct history_block *block;
+	long long ts, dod;
+	double number;
+	uint64_t value;
+	char *end;
+	int i;
+
+	if (!hist->header || !md->value)
+		return 1;
+	number = strtod(md->value, &end);
+	if (end == md->value || *end || !isfinite(number)) {
+		hist->not_numeric++;
+		return 1;
+	}
+	i = _history_find(hist, md);
+	if (i == -1)
+		return -1;
+	if (i == -2) {
+		hist->no_room++;
+		return 1;
+	}
+
+	ts = _history_now();
+	seg = _history_segment(hist, i);
+	block = _history_block(seg, seg->head);
+	if (block->count) {
+		if (ts < block->last)
+			ts = block->last;		// Clock stepped back
+		dod = ts - block->last - block->delta;
+		if (block->bits + HISTORY_POINT_BITS > HISTORY_BLOCK_BITS || block->count == UINT16_MAX
+				|| dod < INT32_MIN || dod > INT32_MAX) {
+			// Overwrites the oldest block
+			seg->head = (seg->head + 1) % hist->header->blocks;
+			block = _history_block(seg, seg->head);
+			memset(block, 0, HISTORY_BLOCK_SIZE);
+			hist->blocks++;
+		}
+	}
+	memcpy(&value, &number, sizeof(value));
+	_history_encode(block, ts, value);
+	hist->points++;
+
+	return 0;
+}
+
+// Calls cb for every point of the module between from and to, oldest first.
+// Returns the number of points, -1 if the module has no history.
+int history_query(struct history *hist, const char *md_id, long long from, long long to, history_point cb, void *arg)
+{
+	struct history_segment *seg;
+	struct history_block *block;
+	int i, j, points = 0;
+
+	if (!hist->header)
+		return -1;
+	for (i = 0; ; i++) {
+		if (i == (int)hist->header->segments)
+			return -1;
+		seg = _history_segment(hist, i);
+		if (!strncmp(seg->id, md_id, sizeof(seg->id)))
+			break;
+	}
+
+	for (j = 1; j <= (int)hist->header->blocks; j++) {
+		block = _history_block(seg, (seg->head + j) % hist->header->blocks);
+		if (!block->count || block->last < from || block->first > to)
+			continue;
+		if (_history_decode(block, from, to, cb, arg, &points))
+			break;
+	}
+
+	return points;
+}
+
+void history_print_stats(struct history *hist)
+{
+	struct history_segment *seg;
+	int i, used = 0;
+
+	for (i = 0; i < (int)hist->header->segments; i++) {
+		seg = _history_segment(hist, i);
+		if (seg->id[0])
+			used++;
+	}
+	printf("History - modules: %d/%u, points: %lu, blocks filled: %lu, not numeric: %lu, no room: %lu, evicted: %lu\n"
+		, used, hist->header->segments, hist->points, hist->blocks, hist->not_numeric, hist->no_room, hist->evicted);
+}
+
+void history_close(struct history *hist)
+{
+	if (hist->header) {
+		msync(hist->header, hist->size, MS_SYNC);
+		munmap(hist->header, hist->size);
+		hist->header = NULL;
+	}
+	free(hist->by_index);
+	hist->by_index = NULL;
+	hist->by_index_len = 0;
+}
@@ -0,0 +1,103 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_MAGIC 0x4D424853
+#define HISTORY_VERSION 1
+#define HISTORY_MODULES 64
+#define HISTORY_SIZE 4096				// Bytes of history per module
+#define HISTORY_BLOCK_SIZE 256
+#define HISTORY_POINT_BITS 113			// Worst case of a compressed point
+
+// Numeric readings of the modules in a file mapped in memory. Each module
+// claims a segment, a ring of fixed size blocks that overwrites its
+// oldest block once full, so the file never grows past
+// modules * size bytes. With every segment claimed, a new module takes
+// over the one that went the longest without a reading.
+//
+// Blocks are compressed like Gorilla: the first point is kept in the
+// block header, the next timestamps as delta of deltas and the values as
+// the XOR with the previous one.
+
+struct history_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t segments;
+	uint32_t blocks;				// Per segment
+	uint32_t block_size;
+	uint32_t pad;
+};
+
+struct history_segment {
+	char id[8];						// Module, empty when the segment is free
+	uint32_t head;					// Block being written
+	uint32_t pad;
+};
+
+struct history_block {
+	int64_t first;					// Timestamps in msecs since the epoch
+	uint64_t first_value;			// Values as the bits of a double
+	int64_t last;
+	int64_t delta;					// Between the last two points
+	uint64_t value;					// Last one
+	uint16_t count;					// 0 when the block is empty
+	uint16_t bits;					// Used in data
+	uint8_t leading;				// Zeros around the last stored XOR
+	uint8_t trailing;
+	uint8_t pad[2];
+	uint8_t data[];
+};
+
+struct history {
+	struct history_header *header;	// NULL when not used
+	size_t size;
+	size_t segment_size;
+	int *by_index;					// Segment of each module index, -1 unknown, -2 none
+	int by_index_len;
+	unsigned long points;
+	unsigned long blocks;			// Blocks filled
+	unsigned long not_numeric;
+	unsigned long no_room;			// Readings of modules without a segment
+	unsigned long evicted;			// Segments taken over from another module
+};
+
+struct module;
+
+// Returns non zero to stop the query
+typedef int (*history_point)(void *, long long, double);
+
+void history_init(struct history *);
+int history_open(struct history *, const char *, int, int);
+int history_add(struct history *, struct module *);
+void history_forget(struct history *, struct module *);
+int history_query(struct history *, const char *, long long, long long, history_point, void *);
+void history_print_stats(struct history *);
+void history_close(struct history *);
+
+#endif
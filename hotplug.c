@@ -0,0 +1,253 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "hotplug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#define HOTPLUG_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM)
+#define HOTPLUG_SYS_DEPTH 4			// tty -> port -> interface -> usb device
+
+int hotplug_init(struct hotplug *hp, const char *port, const char *usb_id)
+{
+	unsigned int vid, pid;
+	char *sep;
+
+	hp->fd = -1;
+	hp->dev_wd = -1;
+	hp->port_wd = -1;
+	hp->vid = -1;
+	hp->pid = -1;
+	hp->node[0] = 0;
+	hp->path[0] = 0;
+
+	if (strlen(port) >= PATH_MAX) {
+		fprintf(stderr, "Error: Serial port path too long.\n");
+		return 1;
+	}
+
+	// Split the port in folder and name, by-id links live out of /dev
+	sep = strrchr(port, '/');
+	if (sep) {
+		memcpy(hp->port_dir, port, sep - port);
+		hp->port_dir[sep - port] = 0;
+		strcpy(hp->port_name, sep + 1);
+	} else {
+		strcpy(hp->port_dir, ".");
+		strcpy(hp->port_name, port);
+	}
+
+	if (usb_id) {
+		if (sscanf(usb_id, "%4x:%4x", &vid, &pid) != 2) {
+			fprintf(stderr, "Error: Invalid usb_id: %s\n", usb_id);
+			return 1;
+		}
+		hp->vid = vid;
+		hp->pid = pid;
+	}
+
+	return 0;
+}
+
+// The by-id folder comes and goes with the devices, retried on every tty event
+static void _hotplug_watch_port(struct hotplug *hp)
+{
+	if (hp->port_wd != -1 || !strcmp(hp->port_dir, "/dev"))
+		return;
+
+	hp->port_wd = inotify_add_watch(hp->fd, hp->port_dir, HOTPLUG_EVENTS);
+}
+
+int hotplug_watch(struct hotplug *hp)
+{
+	hp->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (hp->fd == -1)
+		return -1;
+
+	hp->dev_wd = inotify_add_watch(hp->fd, "/dev", HOTPLUG_EVENTS);
+	if (hp->dev_wd == -1) {
+		close(hp->fd);
+		hp->fd = -1;
+		return -1;
+	}
+	_hotplug_watch_port(hp);
+
+	return 0;
+}
+
+// Returns a mask of HOTPLUG_ADD (a candidate port showed up) and
+// HOTPLUG_REMOVE (the open port went away), 0 when nothing happened
+int hotplug_poll(struct hotplug *hp)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+	int rc = 0;
+
+	if (hp->fd == -1)
+		return 0;
+
+	while ((len = read(hp->fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+
+			if (ev->mask & IN_IGNORED) {
+				if (ev->wd == hp->port_wd)
+					hp->port_wd = -1;
+				continue;
+			}
+			if (!ev->len)
+				continue;
+
+			if (ev->wd == hp->dev_wd) {
+				if (strncmp(ev->name, "tty", 3))
+					continue;
+
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					if (!strcmp(ev->name, hp->node))
+						rc |= HOTPLUG_REMOVE;
+				} else {
+					// Any new tty may be ours when matching usb ids or links
+					if (hp->vid != -1 || strcmp(hp->port_dir, "/dev") || !strcmp(ev->name, hp->port_name))
+						rc |= HOTPLUG_ADD;
+					_hotplug_watch_port(hp);
+				}
+			} else if (ev->wd == hp->port_wd) {
+				if (strcmp(ev->name, hp->port_name))
+					continue;
+
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+					rc |= HOTPLUG_REMOVE;
+				else
+					rc |= HOTPLUG_ADD;
+			}
+		}
+	}
+
+	return rc;
+}
+
+static int _hotplug_read_hex(const char *dir, const char *name, unsigned int *value)
+{
+	char file[PATH_MAX];
+	FILE *fptr;
+	int rc;
+
+	snprintf(file, sizeof(file), "%s/%s", dir, name);
+	fptr = fopen(file, "r");
+	if (!fptr)
+		return 1;
+
+	rc = fscanf(fptr, "%x", value) != 1;
+	fclose(fptr);
+
+	return rc;
+}
+
+// Walk up the sysfs device path to the usb device and compare its ids
+static bool _hotplug_usb_match(struct hotplug *hp, char *dir)
+{
+	unsigned int vid, pid;
+	char *sep;
+	int i;
+
+	for (i = 0; i < HOTPLUG_SYS_DEPTH; i++) {
+		if (!_hotplug_read_hex(dir, "idVendor", &vid)) {
+			if (_hotplug_read_hex(dir, "idProduct", &pid))
+				return false;
+			return (int)vid == hp->vid && (int)pid == hp->pid;
+		}
+
+		sep = strrchr(dir, '/');
+		if (!sep || sep == dir)
+			return false;
+		*sep = 0;
+	}
+
+	return false;
+}
+
+// Port to open: the configured one, or the first tty of a device with
+// matching usb ids. NULL when no such device is plugged.
+char *hotplug_find(struct hotplug *hp, char *port)
+{
+	char sys[PATH_MAX], real[PATH_MAX];
+	struct dirent *ent;
+	DIR *dir;
+
+	if (hp->vid == -1)
+		return port;
+
+	dir = opendir("/sys/class/tty");
+	if (!dir)
+		return NULL;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device", ent->d_name);
+		if (!realpath(sys, real))
+			continue;		// Virtual terminals have no device
+
+		if (_hotplug_usb_match(hp, real)) {
+			snprintf(hp->path, sizeof(hp->path), "/dev/%s", ent->d_name);
+			closedir(dir);
+			return hp->path;
+		}
+	}
+	closedir(dir);
+
+	return NULL;
+}
+
+// Remember the tty behind the open port, links included, to spot its removal
+void hotplug_opened(struct hotplug *hp, const char *path)
+{
+	char real[PATH_MAX];
+	char *sep;
+
+	hp->node[0] = 0;
+	if (!realpath(path, real))
+		return;
+
+	sep = strrchr(real, '/');
+	snprintf(hp->node, sizeof(hp->node), "%s", sep ? sep + 1 : real);
+}
+
+void hotplug_cleanup(struct hotplug *hp)
+{
+	if (hp->fd != -1) {
+		close(hp->fd);
+		hp->fd = -1;
+	}
+}
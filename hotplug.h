@@ -0,0 +1,52 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <limits.h>
+
+#define HOTPLUG_ADD 1
+#define HOTPLUG_REMOVE 2
+
+struct hotplug {
+	int fd;							// inotify, -1 when not watching
+	int dev_wd;
+	int port_wd;					// port folder when not /dev (/dev/serial/by-id)
+	char port_dir[PATH_MAX];
+	char port_name[PATH_MAX];
+	int vid;						// usb ids, -1 to match the port path
+	int pid;
+	char node[PATH_MAX];			// tty of the open port (ttyACM0)
+	char path[PATH_MAX];
+};
+
+int hotplug_init(struct hotplug *, const char *, const char *);
+int hotplug_watch(struct hotplug *);
+int hotplug_poll(struct hotplug *);
+char *hotplug_find(struct hotplug *, char *);
+void hotplug_opened(struct hotplug *, const char *);
+void hotplug_cleanup(struct hotplug *);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "journal.h"
+#include "device.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+static unsigned int _journal_crc32(const char *data, int len, unsigned int crc)
+{
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= (unsigned char)*data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+// Records are kept in the stdio buffer until the next commit
+int journal_open(struct journal *jrnl, char *path)
+{
+	jrnl->path = path;
+	jrnl->size = 0;
+	jrnl->pending = 0;
+	jrnl->commit_at = 0;
+	jrnl->records = 0;
+	jrnl->commits = 0;
+
+	jrnl->fptr = fopen(path, "a+");
+	if (!jrnl->fptr) {
+		fprintf(stderr, "Error opening journal \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// Call apply with the device id and line of every valid record.
+// Returns the number of records applied, -1 if apply failed.
+int journal_replay(struct journal *jrnl, int (*apply)(char *, char *))
+{
+	char buf[JOURNAL_LINE_SIZE];
+	char *dev_id, *line;
+	unsigned int crc;
+	long valid = 0;
+	int len, cnt = 0;
+
+	rewind(jrnl->fptr);
+	while (fgets(buf, JOURNAL_LINE_SIZE, jrnl->fptr)) {
+		len = strlen(buf);
+		if (buf[len - 1] != '\n')
+			break;
+		buf[--len] = 0;
+		if (len < 9 + DEVICE_ID_SIZE + 1 || buf[8] != ',' || buf[9 + DEVICE_ID_SIZE] != ',')
+			break;
+		crc = strtoul(buf, NULL, 16);
+		if (crc != _journal_crc32(&buf[9], len - 9, 0))
+			break;
+
+		dev_id = &buf[9];
+		dev_id[DEVICE_ID_SIZE] = 0;
+		line = &dev_id[DEVICE_ID_SIZE + 1];
+		if (apply(dev_id, line) == -1)
+			return -1;
+		cnt++;
+		valid = ftell(jrnl->fptr);
+	}
+	// Cut the torn tail, or the next records would be appended after it
+	fseek(jrnl->fptr, 0, SEEK_END);
+	if (ftell(jrnl->fptr) != valid) {
+		fprintf(stderr, "Journal: invalid record after %d records, ignoring the rest.\n", cnt);
+		if (ftruncate(fileno(jrnl->fptr), valid))
+			fprintf(stderr, "Error truncating journal: %s\n", strerror(errno));
+		fseek(jrnl->fptr, 0, SEEK_END);
+	}
+	jrnl->size = valid;
+
+	return cnt;
+}
+
+int journal_append(struct journal *jrnl, const char *dev_id, const char *line)
+{
+	char buf[JOURNAL_LINE_SIZE];
+	int len;
+
+	if (!jrnl->fptr)
+		return 0;
+
+	len = snprintf(buf, JOURNAL_LINE_SIZE, "%s,%s", dev_id, line);
+	if (len >= JOURNAL_LINE_SIZE - 10)
+		return 1;
+	len = fprintf(jrnl->fptr, "%08x,%s\n", _journal_crc32(buf, len, 0), buf);
+	if (len < 0) {
+		fprintf(stderr, "Error writing journal: %s\n", strerror(errno));
+		return 1;
+	}
+	jrnl->size += len;
+	jrnl->records++;
+	if (!jrnl->pending++)
+		jrnl->commit_at = getMillis() + JOURNAL_COMMIT_MSECS;
+
+	return 0;
+}
+
+// Sync every record appended since the last commit
+int journal_commit(struct journal *jrnl)
+{
+	if (!jrnl->fptr || !jrnl->pending)
+		return 0;
+
+	jrnl->pending = 0;
+	if (fflush(jrnl->fptr) || fsync(fileno(jrnl->fptr))) {
+		fprintf(stderr, "Error writing journal: %s\n", strerror(errno));
+		return 1;
+	}
+	jrnl->commits++;
+	return 0;
+}
+
+// Everything in the journal is saved, start over
+int journal_truncate(struct journal *jrnl)
+{
+	if (!jrnl->fptr)
+		return 0;
+
+	jrnl->pending = 0;
+	if (fflush(jrnl->fptr) || ftruncate(fileno(jrnl->fptr), 0) || fsync(fileno(jrnl->fptr))) {
+		fprintf(stderr, "Error truncating journal: %s\n", strerror(errno));
+		return 1;
+	}
+	jrnl->size = 0;
+	return 0;
+}
+
+void journal_print_stats(struct journal *jrnl)
+{
+	printf("Journal - records: %lu, commits: %lu, size: %ld\n", jrnl->records, jrnl->commits, jrnl->size);
+}
+
+void journal_close(struct journal *jrnl)
+{
+	if (!jrnl->fptr)
+		return;
+	journal_commit(jrnl);
+	fclose(jrnl->fptr);
+	jrnl->fptr = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+
+#define JOURNAL_COMMIT_MSECS 1000		// Group commit, records are synced at most this late
+#define JOURNAL_COMPACT_SECS 300		// Compaction period when autosave isn't set
+#define JOURNAL_LINE_SIZE 256
+
+// Append only log of the device changes not saved yet, one per line:
+//   <crc32 hex>,<device id>,<device file line>
+// A record whose crc doesn't match ends the replay (torn write).
+
+struct journal {
+	FILE *fptr;						// NULL when not used
+	char *path;
+	long size;						// Bytes since the last compaction
+	int pending;					// Records not synced yet
+	long long commit_at;
+	unsigned long records;
+	unsigned long commits;
+};
+
+int journal_open(struct journal *, char *);
+int journal_replay(struct journal *, int (*)(char *, char *));
+int journal_append(struct journal *, const char *, const char *);
+int journal_commit(struct journal *);
+int journal_truncate(struct journal *);
+void journal_print_stats(struct journal *);
+void journal_close(struct journal *);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "local.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static void _local_drop_client(struct local_client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+	client->id = 0;
+	client->all = false;
+	client->subs_len = 0;
+}
+
+void local_init(struct local_server *server)
+{
+	int i;
+
+	server->fd = -1;
+	server->path = NULL;
+	server->received = 0;
+	server->sent = 0;
+	server->dropped = 0;
+	server->last_id = 0;
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		server->clients[i].fd = -1;
+		server->clients[i].id = 0;
+		server->clients[i].all = false;
+		server->clients[i].subs_len = 0;
+	}
+}
+
+// A socket left by a previous run is replaced. It is created with mode,
+// whatever the umask, as anyone who can connect drives the modules.
+int local_open(struct local_server *server, char *path, int mode)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: local_socket path too long: %s\n", path);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	server->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->fd == -1) {
+		fprintf(stderr, "Error: local socket: %s\n", strerror(errno));
+		return 1;
+	}
+	unlink(path);
+	mask = umask(~mode & 0777);
+	rc = bind(server->fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc == -1 || listen(server->fd, LOCAL_CLIENTS) == -1) {
+		fprintf(stderr, "Error: local socket \"%s\": %s\n", path, strerror(errno));
+		close(server->fd);
+		server->fd = -1;
+		return 1;
+	}
+	server->path = path;
+
+	return 0;
+}
+
+// Returns the new client, NULL if there was none or no room for it
+struct local_client *local_accept(struct local_server *server)
+{
+	struct local_client *client = NULL;
+	int fd, i;
+
+	fd = accept(server->fd, NULL, NULL);
+	if (fd == -1)
+		return NULL;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		if (server->clients[i].fd == -1) {
+			client = &server->clients[i];
+			break;
+		}
+	}
+	if (!client) {
+		fprintf(stderr, "Error: Too many local clients.\n");
+		close(fd);
+		return NULL;
+	}
+	client->fd = fd;
+	if (++server->last_id <= 0)
+		server->last_id = 1;
+	client->id = server->last_id;
+
+	return client;
+}
+
+// Client from its id, NULL once it is gone
+struct local_client *local_client_get(struct local_server *server, int id)
+{
+	int i;
+
+	if (!id)
+		return NULL;
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		if (server->clients[i].id == id)
+			return &server->clients[i];
+	}
+	return NULL;
+}
+
+// Next message of the client, NUL terminated.
+// Returns its length, 0 if there is none, -1 when the client is gone.
+int local_recv(struct local_server *server, struct local_client *client, char *buf, int size)
+{
+	int len;
+
+	len = recv(client->fd, buf, size - 1, MSG_DONTWAIT);
+	if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (len <= 0) {
+		_local_drop_client(client);
+		return -1;
+	}
+	buf[len] = 0;
+	server->received++;
+
+	return len;
+}
+
+// "*" stands for every module.
+// Returns 1 if there is no room for another subscription.
+int local_subscribe(struct local_client *client, const char *md_id, bool on)
+{
+	int i;
+
+	if (!strcmp(md_id, "*")) {
+		client->all = on;
+		if (!on)
+			client->subs_len = 0;
+		return 0;
+	}
+
+	for (i = 0; i < client->subs_len; i++) {
+		if (!strcmp(client->subs[i], md_id))
+			break;
+	}
+	if (!on) {
+		if (i < client->subs_len)
+			memcpy(client->subs[i], client->subs[--client->subs_len], DEVICE_MD_ID_SIZE + 1);
+		return 0;
+	}
+	if (i < client->subs_len)
+		return 0;
+	if (client->subs_len == LOCAL_SUBS)
+		return 1;
+	strncpy(client->subs[client->subs_len], md_id, DEVICE_MD_ID_SIZE);
+	client->subs[client->subs_len++][DEVICE_MD_ID_SIZE] = 0;
+
+	return 0;
+}
+
+bool local_subscribed(struct local_client *client, const char *md_id)
+{
+	int i;
+
+	if (client->all)
+		return true;
+	for (i = 0; i < client->subs_len; i++) {
+		if (!strcmp(client->subs[i], md_id))
+			return true;
+	}
+	return false;
+}
+
+// Never blocks, the message is dropped if the client's queue is full
+int local_send(struct local_server *server, struct local_client *client, const char *msg, int len)
+{
+	if (send(client->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len) {
+		server->sent++;
+		return 0;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		server->dropped++;
+		return 1;
+	}
+	_local_drop_client(client);
+	return -1;
+}
+
+// Send to the clients subscribed to the module
+void local_publish(struct local_server *server, const char *md_id, const char *msg, int len)
+{
+	struct local_client *client;
+	int i;
+
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		client = &server->clients[i];
+		if (client->fd != -1 && local_subscribed(client, md_id))
+			local_send(server, client, msg, len);
+	}
+}
+
+void local_print_stats(struct local_server *server)
+{
+	int i, clients = 0;
+
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		if (server->clients[i].fd != -1)
+			clients++;
+	}
+	printf("Local socket - clients: %d, received: %lu, sent: %lu, dropped: %lu\n", clients, server->received, server->sent, server->dropped);
+}
+
+void local_close(struct local_server *server)
+{
+	int i;
+
+	for (i = 0; i < LOCAL_CLIENTS; i++) {
+		if (server->clients[i].fd != -1)
+			_local_drop_client(&server->clients[i]);
+	}
+	if (server->fd != -1) {
+		close(server->fd);
+		unlink(server->path);
+	}
+	server->fd = -1;
+}
@@ -0,0 +1,70 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <stdbool.h>
+
+#include "device.h"
+
+#define LOCAL_CLIENTS 16
+#define LOCAL_SUBS 32					// Module subscriptions of a client
+#define LOCAL_MSG_SIZE 256
+#define LOCAL_MODE 0660					// Owner and group of the bridge can connect
+
+// Unix SOCK_SEQPACKET socket for the clients on the same box, one
+// message per packet in the format of the config topic payloads.
+
+struct local_client {
+	int fd;							// -1 when free
+	int id;							// Not reused by later clients, 0 when free
+	bool all;						// Subscribed to every module
+	char subs[LOCAL_SUBS][DEVICE_MD_ID_SIZE + 1];
+	int subs_len;
+};
+
+struct local_server {
+	int fd;							// -1 when not used
+	char *path;
+	struct local_client clients[LOCAL_CLIENTS];
+	int last_id;
+	unsigned long received;
+	unsigned long sent;
+	unsigned long dropped;			// Client not reading fast enough
+};
+
+void local_init(struct local_server *);
+int local_open(struct local_server *, char *, int);
+struct local_client *local_accept(struct local_server *);
+struct local_client *local_client_get(struct local_server *, int);
+int local_recv(struct local_server *, struct local_client *, char *, int);
+int local_subscribe(struct local_client *, const char *, bool);
+bool local_subscribed(struct local_client *, const char *);
+int local_send(struct local_server *, struct local_client *, const char *, int);
+void local_publish(struct local_server *, const char *, const char *, int);
+void local_print_stats(struct local_server *);
+void local_close(struct local_server *);
+
+#endif
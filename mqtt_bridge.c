@@ -23,32 +23,54 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #include <time.h>
 #include <sys/time.h>
+#include <sys/poll.h>
 
 #include <mosquitto.h>
 
 #include "mqtt_bridge.h"
+#include "alias.h"
+#include "cbor.h"
+#include "fmt.h"
 #include "utils.h"
 #include "arduino-serial-lib.h"
 #include "device.h"
 #include "serial.h"
+#include "hotplug.h"
+#include "command.h"
+#include "poll.h"
+#include "codec.h"
+#include "registry.h"
+#include "bloom.h"
+#include "journal.h"
+#include "state.h"
+#include "local.h"
+#include "shm.h"
+#include "history.h"
 #include "netdev.c"
 
 #define MICRO_PER_SECOND	1000000.0
-#define SERIAL_MAX_BUF 100
+#define SERIAL_MAX_BUF 256				// Room for a PROTO_MD_BATCH of a multi-sensor node
+#define SERIAL_COBS_FAILURES 3			// Invalid frames in a row before going back to ASCII
 #define MAX_OUTPUT 256
 #define GBUF_SIZE 100
+#define HISTORY_POINTS_SIZE (MAX_OUTPUT - 32)	// Readings of a PROTO_HISTORY record, the rest holds its other fields
+#define SERIAL_FRAME_MAX (GBUF_SIZE + GBUF_SIZE / 254 + 2)	// A record and its CRC from gbuf, COBS encoded and delimited
 
 const char version[] = "0.0.1";
 
 struct bridge bridge;
+struct serial_link serial_link;
 
 const char eolchar = '\n';
 
@@ -59,9 +81,22 @@ struct bridge_config config;
 static double downspeed, upspeed;
 static bool every30s = false;
 static bool quiet = false;
-static bool connected = true;
+static bool connected = false;			// Set once the broker accepted the connection
+static long long mqtt_retry_at = 0;		// msecs, 0 when no reconnect is planned
+static int mqtt_backoff = MQTT_BACKOFF_MIN;
+static struct alias_table aliases;
+static struct serial_queue serial_out;
+static struct hotplug hotplug;
+static struct poll_table polls;
+static struct registry registry;
+static struct journal journal;
+static struct local_server local;
+static struct shm_table latest;			// Last values for readers on the box
+static struct history history;
+static struct bloom saved_devices;		// Ids of devices_folder, skips the disk for unknown ones
 
 char gbuf[GBUF_SIZE + 1];
+uint8_t cbuf[GBUF_SIZE];
 
 void handle_signal(int signum)
 {
@@ -146,11 +181,16 @@ void each_sec(int x)
 	alarm(1);
 }
 
-int mqtt_publish(struct mosquitto *mosq, char *topic, char *payload)
+int mqtt_publish_qos(struct mosquitto *mosq, char *topic, char *payload, int payload_len, int qos, bool retain)
 {
 	int rc;
 
-	rc = mosquitto_publish(mosq, NULL, topic, strlen(payload), payload, config.mqtt_qos, false);
+	if (payload_len < 0) {
+		fprintf(stderr, "Error: MQTT payload too big for topic: %s\n", topic);
+		return 0;
+	}
+
+	rc = mosquitto_publish(mosq, NULL, topic, payload_len, payload, qos, retain);
 	if (rc) {
 		fprintf(stderr, "Error: MQTT publish returned: %s\n", mosquitto_strerror(rc));
 		return 0;
@@ -158,62 +198,921 @@ int mqtt_publish(struct mosquitto *mosq, char *topic, char *payload)
 	return 1;
 }
 
-int mqtt_publish_bandwidth(struct mosquitto *mosq, char *topic) {
-	int payload_len;
+int mqtt_publish_len(struct mosquitto *mosq, char *topic, char *payload, int payload_len)
+{
+	return mqtt_publish_qos(mosq, topic, payload, payload_len, config.mqtt_qos, false);
+}
+
+int mqtt_publish(struct mosquitto *mosq, char *topic, char *payload)
+{
+	return mqtt_publish_len(mosq, topic, payload, strlen(payload));
+}
+
+// Publish to a module topic. With MQTT v5 the topic is replaced by a topic alias
+// once the broker knows it, and the module origin can travel as user properties.
+int mqtt_publish_md_len(struct mosquitto *mosq, struct module *md, char *payload, int payload_len)
+{
+	mosquitto_property *props = NULL;
+	char *topic;
+	bool known = false;
+	int alias = 0;
+	int qos, rc;
+
+	qos = md->qos == MODULE_QOS_DEFAULT ? config.mqtt_qos : md->qos;
+
+	if (config.mqtt_version != MQTT_PROTOCOL_V5)
+		return mqtt_publish_qos(mosq, md->topic, payload, payload_len, qos, md->retain);
+
+	if (payload_len < 0) {
+		fprintf(stderr, "Error: MQTT payload too big for topic: %s\n", md->topic);
+		return 0;
+	}
+
+	topic = md->topic;
+
+	// QoS 0 messages are never queued for resend, so an alias can not
+	// leak into a later connection where the broker does not know it.
+	if (qos == 0 && connected) {
+		alias = alias_get(&aliases, md->topic, &known);
+		if (alias == -1) {
+			run = 0;
+			return 0;
+		}
+		if (alias) {
+			rc = mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias);
+			if (rc) {
+				alias_forget(&aliases, alias);
+				alias = 0;
+			} else if (known) {
+				topic = NULL;
+			}
+		}
+	}
+
+	if (config.mqtt_user_props) {
+		rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "device", md->device);
+		if (!rc)
+			rc = mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "module", md->id);
+		if (rc)
+			fprintf(stderr, "Error: MQTT user property: %s\n", mosquitto_strerror(rc));
+	}
+
+	rc = mosquitto_publish_v5(mosq, NULL, topic, payload_len, payload, qos, md->retain, props);
+	mosquitto_property_free_all(&props);
+	if (rc) {
+		if (alias && !known)
+			alias_forget(&aliases, alias);
+		fprintf(stderr, "Error: MQTT publish returned: %s\n", mosquitto_strerror(rc));
+		return 0;
+	}
+	return 1;
+}
+
+int mqtt_publish_md(struct mosquitto *mosq, struct module *md, char *payload)
+{
+	return mqtt_publish_md_len(mosq, md, payload, strlen(payload));
+}
+
+// Load a saved device, from the registry snapshot when there is one.
+// Returns 1 if the device isn't saved.
+int bridge_load_device(char *id)
+{
+	struct device *dev;
+	int rc;
+
+	if (config.registry_file) {
+		rc = registry_load(&registry, &bridge, id);
+	} else {
+		if (!config.devices_folder || !bloom_check(&saved_devices, id))
+			return 1;
+		rc = device_load(&bridge, config.devices_folder, id);
+		if (rc == 1)
+			saved_devices.false_positives++;
+	}
+	if (!rc && (dev = device_get(&bridge, id)))
+		dev->stored = true;
+	return rc;
+}
+
+// Save devices to the registry snapshot in one go, or to their files.
+// Returns 1 if any of them couldn't be saved.
+int bridge_save_devices(struct device **devs, int len)
+{
+	int i, rc, return_val = 0;
+
+	if (config.registry_file) {
+		rc = registry_save(&registry, &bridge, devs, len);
+		if (rc)
+			return rc;
+		for (i = 0; i < len; i++) {
+			devs[i]->dirty = false;
+			devs[i]->stored = true;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		rc = device_save(&bridge, config.devices_folder, devs[i]);
+		if (rc == -1)
+			return -1;
+		if (rc) {
+			return_val = 1;
+		} else {
+			devs[i]->stored = true;
+			bloom_add(&saved_devices, devs[i]->id);
+		}
+	}
+	return return_val;
+}
+
+// Mark the device to be saved, the change of module md goes to the journal
+// right away. New devices are only kept from their first module change on,
+// so ids that never announce a module don't reach the disk.
+void device_changed(struct device *dev, struct module *md)
+{
+	char line[TOPIC_MAX_SIZE + 32];
+
+	dev->dirty = true;
+	if (!journal.fptr)
+		return;
+
+	// Replay needs the device before its modules
+	if (!dev->stored) {
+		snprintf(line, sizeof(line), "device,%s,%s", dev->id, dev->md_deps->id);
+		journal_append(&journal, dev->id, line);
+		dev->stored = true;
+	}
+	device_md_line(md, line, sizeof(line), true);
+	journal_append(&journal, dev->id, line);
+}
+
+// Journal replay, the device stays dirty until the next compaction
+int replay_change(char *dev_id, char *line)
+{
+	struct device *dev;
+	int rc;
+
+	if (!device_get(&bridge, dev_id)) {
+		rc = bridge_load_device(dev_id);
+		if (rc == -1)
+			return -1;
+	}
+	rc = device_load_line(&bridge, dev_id, line);
+	if (rc == -1)
+		return -1;
+	if (rc && config.debug) printf("Journal - invalid change - device: %s\n", dev_id);
+
+	dev = device_get(&bridge, dev_id);
+	if (dev) {
+		dev->dirty = true;
+		dev->stored = true;
+	}
+	return 0;
+}
+
+// Save the devices changed since the last save, the journal is compacted
+// once they all are
+int autosave(void)
+{
+	struct device **devs;
+	int i, len = 0, rc;
+
+	for (i = 0; i < bridge.devices_len; i++) {
+		if (bridge.devices[i].dirty)
+			len++;
+	}
+	if (!len)
+		return journal_truncate(&journal);
+
+	if ((devs = malloc(len * sizeof(struct device *))) == NULL) {
+		fprintf(stderr, "No memory left.\n");
+		return -1;
+	}
+	len = 0;
+	for (i = 0; i < bridge.devices_len; i++) {
+		if (bridge.devices[i].dirty)
+			devs[len++] = &bridge.devices[i];
+	}
+
+	if (config.debug > 1) printf("Autosave - devices: %d\n", len);
+	rc = bridge_save_devices(devs, len);
+	free(devs);
+	if (rc)
+		return rc;
+	return journal_truncate(&journal);
+}
+
+// Seed the saved devices filter with the device files of devices_folder
+int saved_devices_load(void)
+{
+	struct dirent *ent;
+	DIR *dir;
+
+	if (bloom_init(&saved_devices, BLOOM_BITS) == -1)
+		return -1;
+
+	dir = opendir(config.devices_folder);
+	if (!dir) {
+		fprintf(stderr, "Error: Can't open devices_folder: %s\n", strerror(errno));
+		return 0;
+	}
+	while ((ent = readdir(dir))) {
+		if (device_isValid_id(ent->d_name))
+			bloom_add(&saved_devices, ent->d_name);
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+// Build "<prefix><id>" into gbuf, used for the per device topics
+char *device_topic(const char *prefix, const char *id)
+{
+	struct fmt f;
+
+	fmt_init(&f, gbuf, GBUF_SIZE + 1);
+	fmt_str(&f, prefix);
+	fmt_str(&f, id);
+	fmt_end(&f);
+	return gbuf;
+}
+
+// Send "<PROTO_MD_RAW>,<md_id>,<state>" to the local clients subscribed to the module
+void local_reading(struct local_client *client, struct module *md)
+{
+	char msg[LOCAL_MSG_SIZE];
+	struct fmt f;
+	int len;
+
+	if (local.fd == -1 || !md->value)
+		return;
+
+	fmt_init(&f, msg, LOCAL_MSG_SIZE);
+	fmt_int(&f, PROTO_MD_RAW);
+	fmt_char(&f, ',');
+	fmt_str(&f, md->id);
+	fmt_char(&f, ',');
+	fmt_str(&f, md->value);
+	len = fmt_end(&f);
+	if (len == -1)
+		return;
+
+	if (client)
+		local_send(&local, client, msg, len);
+	else
+		local_publish(&local, md->id, msg, len);
+}
+
+// A new state of the module for everything on the box that follows it
+void module_share(struct module *md)
+{
+	local_reading(NULL, md);
+	shm_update(&latest, md);
+	if (history_add(&history, md) == -1)
+		run = 0;
+}
+
+// Keep the value as the module last known state.
+// Readings of modules with a format are checked by their codec first, kept
+// as plain numbers and rendered into buf with the template of the format.
+// Returns the payload for the module topic and its length, NULL if rejected.
+char *module_store(struct module *md, char *value, char *buf, int *len)
+{
+	struct codec_reading reading;
+	char plain[CODEC_BUF_SIZE];
+
+	if (md->format == CODEC_RAW) {
+		if (device_set_md_value(md, value) == -1) {
+			run = 0;
+			return NULL;
+		}
+		module_share(md);
+		*len = strlen(value);
+		return value;
+	}
+
+	reading.codec = codec_get(md->type);
+	if (codec_parse(reading.codec, value, md->scale, &reading.value)) {
+		if (config.debug > 1) printf("Invalid reading - module: %s, value: %s\n", md->id, value);
+		return NULL;
+	}
+	reading.type = modules_name[md->type];
+	reading.device = md->device;
+	reading.module = md->id;
+
+	if (codec_render(CODEC_PLAIN, &reading, plain, CODEC_BUF_SIZE) == -1)
+		return NULL;
+	if (device_set_md_value(md, plain) == -1) {
+		run = 0;
+		return NULL;
+	}
+	module_share(md);
+
+	*len = codec_render(md->format, &reading, buf, CODEC_BUF_SIZE);
+	return buf;
+}
+
+// Keep the value as the module last known state, then publish it
+int module_update(struct mosquitto *mosq, struct module *md, char *value)
+{
+	char buf[CODEC_BUF_SIZE];
 	char *payload;
+	int len;
 
-	if (!topic)
-		return 1;
+	payload = module_store(md, value, buf, &len);
+	if (!payload)
+		return 0;
+	return mqtt_publish_md_len(mosq, md, payload, len);
+}
 
-	if (config.debug > 1) printf("down: %f - up: %f\n", downspeed, upspeed);
+// Same for states the bridge sets itself: the cache always follows them,
+// they are only published while connected.
+int module_update_local(struct mosquitto *mosq, struct module *md, char *value)
+{
+	char buf[CODEC_BUF_SIZE];
+	char *payload;
+	int len;
+
+	payload = module_store(md, value, buf, &len);
+	if (!payload || !connected)
+		return 0;
+	return mqtt_publish_md_len(mosq, md, payload, len);
+}
+
+// Readings of several modules of one device: "<md_id>=<value>;<md_id>=<value>...".
+// Each goes to its module topic, or with batch_publish they all go out
+// at once as "<md_id>=<state>;..." on "raw/<device id>".
+void module_batch(struct mosquitto *mosq, struct device *dev, char *msg)
+{
+	char md_id[DEVICE_MD_ID_SIZE + 1];
+	char value[CODEC_BUF_SIZE];
+	char buf[CODEC_BUF_SIZE];
+	char out[MAX_OUTPUT + 1];
+	struct module *md;
+	struct fmt f;
+	char *sep;
+	int len, cnt = 0;
+
+	fmt_init(&f, out, MAX_OUTPUT + 1);
+	while (*msg) {
+		len = strcspn(msg, ";");
+		sep = memchr(msg, '=', len);
+		if (!sep || sep - msg != DEVICE_MD_ID_SIZE || len - DEVICE_MD_ID_SIZE - 1 >= CODEC_BUF_SIZE) {
+			if (config.debug > 1) printf("Invalid batch reading - device: %s\n", dev->id);
+		} else {
+			memcpy(md_id, msg, DEVICE_MD_ID_SIZE);
+			md_id[DEVICE_MD_ID_SIZE] = 0;
+			memcpy(value, sep + 1, len - DEVICE_MD_ID_SIZE - 1);
+			value[len - DEVICE_MD_ID_SIZE - 1] = 0;
+
+			md = device_get_module(&bridge, md_id);
+			if (md && md->enabled && !strcmp(md->device, dev->id)) {
+				if (!config.batch_publish) {
+					module_update(mosq, md, value);
+				} else if (module_store(md, value, buf, &len)) {
+					if (cnt++)
+						fmt_char(&f, ';');
+					fmt_str(&f, md->id);
+					fmt_char(&f, '=');
+					fmt_str(&f, md->value);
+				}
+			}
+		}
+
+		msg += strcspn(msg, ";");
+		if (*msg == ';')
+			msg++;
+	}
+
+	if (cnt)
+		mqtt_publish_len(mosq, device_topic("raw/", dev->id), out, fmt_end(&f));
+}
+
+// CBOR is only sent to controllers and on the bridge own topics (dev == NULL),
+// nodes and other bridges always speak the ASCII protocol.
+bool record_binary(struct device *dev)
+{
+	if (config.encoding != ENCODING_CBOR)
+		return false;
+	return !dev || dev->type == DEVICE_TYPE_CONTROLLER;
+}
+
+// Append the fields of a record to f as comma separated ASCII.
+// Each spec char is one field: 's' string, 'd' int, 'l' long long, 'b' bool, 'f' double rounded to integer.
+void record_ascii(struct fmt *f, const char *spec, va_list ap)
+{
+	const char *field;
+
+	for (field = spec; *field; field++) {
+		if (field != spec)
+			fmt_char(f, ',');
+		switch (*field) {
+			case 's':
+				fmt_str(f, va_arg(ap, char *));
+				break;
+			case 'd':
+			case 'b':
+				fmt_int(f, va_arg(ap, int));
+				break;
+			case 'l':
+				fmt_int(f, va_arg(ap, long long));
+				break;
+			case 'f':
+				fmt_fixed(f, va_arg(ap, double), 0);
+				break;
+		}
+	}
+}
+
+// Format a record as comma separated ASCII or as a CBOR array into buf, of size bytes.
+// Returns the payload and its length in len, -1 if it did not fit.
+char *record_vformat(bool binary, char *buf, int size, int *len, const char *spec, va_list ap)
+{
+	struct cbor cb;
+	struct fmt f;
+	const char *field;
+	double number;
+
+	if (binary) {
+		cbor_init(&cb, (uint8_t *)buf, size);
+		cbor_array(&cb, strlen(spec));
+		for (field = spec; *field; field++) {
+			switch (*field) {
+				case 's':
+					cbor_text(&cb, va_arg(ap, char *));
+					break;
+				case 'd':
+					cbor_int(&cb, va_arg(ap, int));
+					break;
+				case 'l':
+					cbor_int(&cb, va_arg(ap, long long));
+					break;
+				case 'b':
+					cbor_bool(&cb, va_arg(ap, int));
+					break;
+				case 'f':
+					number = va_arg(ap, double);
+					cbor_int(&cb, (long long)(number < 0 ? number - 0.5 : number + 0.5));
+					break;
+			}
+		}
+		*len = cbor_len(&cb);
+		return buf;
+	}
+
+	fmt_init(&f, buf, size);
+	record_ascii(&f, spec, ap);
+	*len = fmt_end(&f);
+	return buf;
+}
+
+// Same as record_vformat(), into gbuf or cbuf
+char *record_format(bool binary, int *len, const char *spec, ...)
+{
+	va_list ap;
+	char *payload;
+
+	va_start(ap, spec);
+	if (binary)
+		payload = record_vformat(binary, (char *)cbuf, GBUF_SIZE, len, spec, ap);
+	else
+		payload = record_vformat(binary, gbuf, GBUF_SIZE + 1, len, spec, ap);
+	va_end(ap);
+	return payload;
+}
+
+int mqtt_publish_record(struct mosquitto *mosq, char *topic, bool binary, const char *spec, ...)
+{
+	va_list ap;
+	char *payload;
+	int len;
+
+	va_start(ap, spec);
+	if (binary)
+		payload = record_vformat(binary, (char *)cbuf, GBUF_SIZE, &len, spec, ap);
+	else
+		payload = record_vformat(binary, gbuf, GBUF_SIZE + 1, &len, spec, ap);
+	va_end(ap);
+	return mqtt_publish_len(mosq, topic, payload, len);
+}
 
-	payload_len = snprintf(NULL, 0, "%.0f,%.0f", upspeed, downspeed);
-	if ((payload = (char *)malloc((payload_len + 1)* (sizeof(char)))) == NULL) {
-		fprintf(stderr, "Error: No memory left.\n");
+// For records that may not fit gbuf, formatted into buf
+int mqtt_publish_record_buf(struct mosquitto *mosq, char *topic, bool binary, char *buf, int size, const char *spec, ...)
+{
+	va_list ap;
+	char *payload;
+	int len;
+
+	va_start(ap, spec);
+	payload = record_vformat(binary, buf, size, &len, spec, ap);
+	va_end(ap);
+	return mqtt_publish_len(mosq, topic, payload, len);
+}
+
+// Answer a local client in ASCII, as its readings are sent. No client, no answer.
+void local_record(struct local_client *client, const char *spec, ...)
+{
+	char msg[LOCAL_MSG_SIZE];
+	struct fmt f;
+	va_list ap;
+	int len;
+
+	if (!client)
+		return;
+
+	fmt_init(&f, msg, LOCAL_MSG_SIZE);
+	va_start(ap, spec);
+	record_ascii(&f, spec, ap);
+	va_end(ap);
+	len = fmt_end(&f);
+	if (len != -1)
+		local_send(&local, client, msg, len);
+}
+
+struct history_reply {
+	struct mosquitto *mosq;
+	struct device *dev;
+	char *md_id;
+	char points[HISTORY_POINTS_SIZE + 1];
+	int len;
+	char out[MAX_OUTPUT + 1];		// The record, gbuf is too small to batch readings
+};
+
+static void history_reply_flush(struct history_reply *reply)
+{
+	reply->points[reply->len] = 0;
+	mqtt_publish_record_buf(reply->mosq, reply->dev->topic, record_binary(reply->dev), reply->out, sizeof(reply->out)
+		, "sdss", bridge.id, PROTO_HISTORY, reply->md_id, reply->points);
+	reply->len = 0;
+}
+
+static int history_reply_point(void *arg, long long ts, double value)
+{
+	struct history_reply *reply = arg;
+	char point[HISTORY_POINTS_SIZE + 1];
+	struct fmt f;
+	int len;
+
+	fmt_init(&f, point, HISTORY_POINTS_SIZE + 1);
+	fmt_int(&f, ts);
+	fmt_char(&f, ':');
+	fmt_number(&f, value);
+	len = fmt_end(&f);
+	if (len == -1)
+		return 0;
+
+	if (reply->len && reply->len + 1 + len > HISTORY_POINTS_SIZE)
+		history_reply_flush(reply);
+	if (reply->len)
+		reply->points[reply->len++] = ';';
+	memcpy(&reply->points[reply->len], point, len);
+	reply->len += len;
+	return 0;
+}
+
+// Readings of the module between from and to, in as many PROTO_HISTORY
+// records as needed. The last one has no points, so a controller knows
+// the range is complete.
+void history_reply(struct mosquitto *mosq, struct device *dev, char *md_id, char *msg)
+{
+	struct history_reply reply;
+	long long from, to = LLONG_MAX;
+	char *end;
+
+	from = strtoll(msg, &end, 10);
+	if (end == msg || (*end && *end != ',')) {
+		if (config.debug > 1) printf("Invalid history range - module: %s\n", md_id);
+		return;
+	}
+	if (*end == ',') {
+		msg = end + 1;
+		to = strtoll(msg, &end, 10);
+		if (end == msg || *end) {
+			if (config.debug > 1) printf("Invalid history range - module: %s\n", md_id);
+			return;
+		}
+	}
+
+	reply.mosq = mosq;
+	reply.dev = dev;
+	reply.md_id = md_id;
+	reply.len = 0;
+
+	history_query(&history, md_id, from, to, history_reply_point, &reply);
+	if (reply.len)
+		history_reply_flush(&reply);
+	mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sds", bridge.id, PROTO_HISTORY, md_id);
+}
+
+void serial_set_framing(int framing)
+{
+	if (bridge.serial_framing != framing && config.debug) printf("Serial framing: %s\n", framing ? "cobs" : "ascii");
+	bridge.serial_framing = framing;
+	bridge.serial_bad_frames = 0;
+}
+
+// A node that reset, or lost the switch to COBS, keeps talking ASCII and
+// never sends the 0x00 delimiter: give up on COBS after a few bad frames,
+// the node asks for it again with PROTO_SERIAL_MODE.
+void serial_bad_frame(void)
+{
+	if (++bridge.serial_bad_frames < SERIAL_COBS_FAILURES)
+		return;
+	if (config.debug > 1) printf("Serial - %d invalid frames.\n", bridge.serial_bad_frames);
+	serial_set_framing(SERIAL_FRAMING_ASCII);
+}
+
+// Queue a record for the serial port, the spec always starts with the device id and the opcode.
+// Sent as a "@M,<fields>" line, or as a binary frame once the port switched to COBS framing.
+// A record still queued with the same key (a module id) is replaced by this one.
+int serial_record(const char *key, const char *spec, ...)
+{
+	uint8_t frame[SERIAL_FRAME_MAX];
+	char *out = gbuf;
+	uint16_t crc;
+	int len;
+	struct fmt f;
+	va_list ap;
+
+	fmt_init(&f, gbuf, GBUF_SIZE + 1);
+	va_start(ap, spec);
+	if (bridge.serial_framing == SERIAL_FRAMING_COBS) {
+		fmt_char(&f, SERIAL_FRAME_MSG);
+		fmt_mem(&f, va_arg(ap, char *), DEVICE_ID_SIZE);
+		fmt_char(&f, va_arg(ap, int));
+		record_ascii(&f, &spec[2], ap);
+	} else {
+		fmt_mem(&f, SERIAL_INIT_MSG, SERIAL_INIT_LEN);
+		record_ascii(&f, spec, ap);
+		fmt_char(&f, eolchar);
+	}
+	va_end(ap);
+	len = fmt_end(&f);
+	if (len != -1 && bridge.serial_framing == SERIAL_FRAMING_COBS) {
+		crc = serial_crc16((uint8_t *)gbuf, len);
+		fmt_char(&f, crc >> 8);
+		fmt_char(&f, crc & 0xFF);
+		len = fmt_end(&f);
+		if (len != -1)
+			len = serial_cobs_encode((uint8_t *)gbuf, len, frame, sizeof(frame) - 1);
+		if (len != -1) {
+			frame[len++] = 0;		// Frame delimiter
+			out = (char *)frame;
+		}
+	}
+	if (len == -1) {
+		if (config.debug > 1) printf("Serial - Message too big.\n");
 		return -1;
 	}
-	snprintf(payload, payload_len + 1, "%.0f,%.0f", upspeed, downspeed);
-	mqtt_publish(mosq, topic, payload);
-	free(payload);
+	if (serial_queue_push(&serial_out, out, len, key)) {
+		if (config.debug > 1) printf("Serial - Queue full, message dropped.\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Commands to a module not yet delivered are replaced by newer ones, unless its type opted out
+bool md_coalesce(struct module *md)
+{
+	return !(config.no_coalesce & (1UL << md->type));
+}
+
+// Readings of disabled modules are dropped before they are parsed or published.
+// msg is "<code>,<md_id>,...", only PROTO_MD_RAW is looked at.
+bool md_dropped(char *msg)
+{
+	char md_id[DEVICE_MD_ID_SIZE + 1];
+	int code = 0;
+
+	while (*msg >= '0' && *msg <= '9')
+		code = code * 10 + *msg++ - '0';
+	if (code != PROTO_MD_RAW || *msg++ != ',')
+		return false;
+	if (strnlen(msg, DEVICE_MD_ID_SIZE + 1) < DEVICE_MD_ID_SIZE + 1 || msg[DEVICE_MD_ID_SIZE] != ',')
+		return false;
+
+	memcpy(md_id, msg, DEVICE_MD_ID_SIZE);
+	md_id[DEVICE_MD_ID_SIZE] = 0;
+	if (device_md_enabled(&bridge, md_id))
+		return false;
+
+	if (config.debug > 2) printf("Module disabled - id: %s\n", md_id);
+	return true;
+}
+
+int mqtt_publish_bandwidth(struct mosquitto *mosq, struct module *md) {
+	char *payload;
+	int payload_len;
+
+	if (!md->topic)
+		return 1;
+
+	if (config.debug > 1) printf("down: %f - up: %f\n", downspeed, upspeed);
+
+	payload = record_format(record_binary(NULL), &payload_len, "ff", upspeed, downspeed);
+	if (record_binary(NULL) || payload_len == -1)
+		mqtt_publish_md_len(mosq, md, payload, payload_len);	// Binary values are not kept as state
+	else
+		module_update(mosq, md, payload);
 
 	return 0;
 }
 
-void on_mqtt_connect(struct mosquitto *mosq, void *obj, int result)
+// Send a sequenced command to its device, again when the ack is late
+void command_send(struct mosquitto *mosq, struct device *dev, struct command *c)
 {
-	int rc;
+	command_sent(dev->commands, c, getMillis() + config.command_timeout);
+	if (config.debug > 2) printf("Command - device: %s seq: %d try: %d\n", dev->id, c->seq, c->tries);
+
+	if (dev->md_deps->type == MODULE_SERIAL) {
+		if (bridge.serial_ready)
+			serial_record(NULL, "sdsds", dev->id, PROTO_MD_TO_RAW_SEQ, c->md_id, c->seq, c->value);
+	} else if (dev->md_deps->type == MODULE_MQTT) {
+		mqtt_publish_record(mosq, dev->topic, false, "sdsds", bridge.id, PROTO_MD_TO_RAW_SEQ, c->md_id, c->seq, c->value);
+	}
+}
+
+// Send the pending commands that fit in the window
+void command_pump(struct mosquitto *mosq, struct device *dev)
+{
+	struct command *c;
+
+	while ((c = command_next(dev->commands, config.command_window)))
+		command_send(mosq, dev, c);
+}
+
+// Report the outcome of a command on the status topic, and to the local
+// client that sent it, then free its slot
+void command_done(struct mosquitto *mosq, struct device *dev, struct command *c, int code)
+{
+	if (config.debug > 1) printf("Command %s - device: %s seq: %d\n", code == PROTO_ACK ? "ack" : "nack", dev->id, c->seq);
+	mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dsd", code, c->md_id, c->seq);
+	local_record(local_client_get(&local, c->origin), "dsd", code, c->md_id, c->seq);
+	command_free(dev->commands, c);
+}
+
+// Retransmit the commands whose ack is late, nack them after command_retries
+void commands_step(struct mosquitto *mosq)
+{
+	struct device *dev;
+	struct command *c;
+	long long now;
+	int i, j;
+
+	now = getMillis();
+	for (i = 0; i < bridge.devices_len; i++) {
+		dev = &bridge.devices[i];
+		if (!dev->commands)
+			continue;
+
+		for (j = 0; j < COMMAND_SLOTS; j++) {
+			c = &dev->commands->slots[j];
+			if (c->state != COMMAND_INFLIGHT || now < c->deadline)
+				continue;
+			if (c->tries > config.command_retries)
+				command_done(mosq, dev, c, PROTO_NACK);
+			else
+				command_send(mosq, dev, c);
+		}
+		command_pump(mosq, dev);
+	}
+}
+
+// Without the session, the broker forgot the subscriptions of the
+// bridge and of the nodes it already knows
+int mqtt_subscribe_all(struct mosquitto *mosq)
+{
+	int i, rc;
+
+	rc = mosquitto_subscribe(mosq, NULL, bridge.config_topic, config.mqtt_qos);
+	for (i = 0; i < bridge.devices_len && !rc; i++) {
+		if (bridge.devices[i].type == DEVICE_TYPE_NODE && bridge.devices[i].md_deps->type == MODULE_MQTT)
+			rc = mosquitto_subscribe(mosq, NULL, device_topic("status/", bridge.devices[i].id), config.mqtt_qos);
+	}
+	if (rc) {
+		fprintf(stderr, "MQTT - Subscribe ERROR: %s\n", mosquitto_strerror(rc));
+		return -1;
+	}
+	return 0;
+}
 
+void on_mqtt_connect(struct mosquitto *mosq, void *obj, int result, int flags)
+{
 	if (!result) {
 		connected = true;
+		mqtt_backoff = MQTT_BACKOFF_MIN;
 		if(config.debug != 0) printf("MQTT Connected.\n");
 
-		rc = mosquitto_subscribe(mosq, NULL, bridge.config_topic, config.mqtt_qos);
-		if (rc) {
-			fprintf(stderr, "MQTT - Subscribe ERROR: %s\n", mosquitto_strerror(rc));
+		if (config.persistent_session && (flags & MQTT_SESSION_PRESENT)) {
+			if (config.debug) printf("MQTT session resumed.\n");
+		} else if (mqtt_subscribe_all(mosq) == -1) {
 			run = 0;
 			return;
 		}
-		snprintf(gbuf, GBUF_SIZE, "%d,%d", PROTO_ST_ALIVE, bridge.modules_len);
-		mqtt_publish(mosq, bridge.status_topic, gbuf);
+		mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dd", PROTO_ST_ALIVE, bridge.modules_len);
 		return;
 	} else {
 		fprintf(stderr, "MQTT - Failed to connect: %s\n", mosquitto_connack_string(result));
     }
 }
 
+void on_mqtt_connect_v5(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *props)
+{
+	uint16_t alias_max = 0;
+
+	if (!result) {
+		// Without the property the broker accepts no aliases at all
+		mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_max, false);
+		alias_reset(&aliases, alias_max);
+		if (config.debug > 1) printf("MQTT topic aliases: %d\n", aliases.max);
+	}
+	on_mqtt_connect(mosq, obj, result, flags);
+}
+
 void on_mqtt_disconnect(struct mosquitto *mosq, void *obj, int rc)
 {
 	connected = false;
+	alias_reset(&aliases, 0);
 	bridge.controller = false;
 	if (config.debug != 0) printf("MQTT Disconnected: %s\n", mosquitto_strerror(rc));
 }
 
-void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *msg)
+// MQTT v5 drops the session with the connection unless CONNECT carries
+// an expiry interval. There is no async v5 connect, so with a persistent
+// session the first TCP connect blocks; libmosquitto keeps the properties
+// for the async reconnects.
+int mqtt_connect(struct mosquitto *mosq)
+{
+	mosquitto_property *props = NULL;
+	int rc;
+
+	if (config.mqtt_version != MQTT_PROTOCOL_V5 || !config.persistent_session)
+		return mosquitto_connect_async(mosq, config.mqtt_host, config.mqtt_port, MQTT_KEEPALIVE);
+
+	rc = mosquitto_property_add_int32(&props, MQTT_PROP_SESSION_EXPIRY_INTERVAL, MQTT_SESSION_EXPIRY);
+	if (rc)
+		return rc;
+	rc = mosquitto_connect_bind_v5(mosq, config.mqtt_host, config.mqtt_port, MQTT_KEEPALIVE, NULL, props);
+	mosquitto_property_free_all(&props);
+	return rc;
+}
+
+// Plan the next connection attempt, the backoff doubles on every failure.
+// The jitter keeps bridges from all coming back at once after a broker restart.
+void mqtt_retry(void)
+{
+	int wait;
+
+	wait = mqtt_backoff / 2 + rand() % (mqtt_backoff / 2 + 1);
+	mqtt_retry_at = getMillis() + wait;
+	if (config.debug > 1) printf("MQTT reconnect in %d msecs.\n", wait);
+
+	mqtt_backoff *= 2;
+	if (mqtt_backoff > MQTT_BACKOFF_MAX)
+		mqtt_backoff = MQTT_BACKOFF_MAX;
+}
+
+// Broker socket events from the main loop poll, never blocks.
+// Without a connection, reconnects once the backoff is over.
+void mqtt_step(struct mosquitto *mosq, short revents)
+{
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (mosquitto_socket(mosq) == -1) {
+		if (!mqtt_retry_at) {
+			mqtt_retry();
+			return;
+		}
+		if (getMillis() < mqtt_retry_at)
+			return;
+		mqtt_retry_at = 0;
+		rc = mosquitto_reconnect_async(mosq);
+		if (rc) {
+			if (config.debug > 1) printf("MQTT reconnect: %s\n", mosquitto_strerror(rc));
+			mqtt_retry();
+		}
+		return;
+	}
+
+	if (revents & (POLLIN | POLLERR | POLLHUP))
+		rc = mosquitto_loop_read(mosq, 1);
+	if (!rc && mosquitto_want_write(mosq))
+		rc = mosquitto_loop_write(mosq, 1);
+	if (!rc)
+		rc = mosquitto_loop_misc(mosq);
+	if (run && rc && config.debug > 2) printf("MQTT loop: %s\n", mosquitto_strerror(rc));
+}
+
+// client is the local client the message came from, it gets the outcome of
+// its changes and commands. NULL for messages of devices.
+void bridge_message(struct mosquitto *mosq, struct device *dev, struct local_client *client, char *msg)
 {
 	char md_id[DEVICE_MD_ID_SIZE + 1];
 	struct module *md;
 	struct device *target_dev;
+	struct command *cmd;
 	int code, i;
+	int qos, retain, seq, replaced, replaced_origin;
 
 	if (config.debug > 2) printf("Bridge - message: %s\n", msg);
 
@@ -222,10 +1121,24 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 		return;
 	}
 
+	// Local clients have no device, they can only drive modules
+	if (!dev && code != PROTO_MD_TO_RAW && code != PROTO_MD_TO_RAW_SEQ && code != PROTO_MD_SET_TOPIC
+			&& code != PROTO_MD_SET_QOS && code != PROTO_MD_SET_ENABLE)
+		return;
+
 	switch (code) {
-		case PROTO_ERROR:
 		case PROTO_ACK:
 		case PROTO_NACK:
+			// Answer to a sequenced command: "<code>,<seq>"
+			if (!getInt(&msg, &seq))
+				return;
+			cmd = command_find(dev->commands, seq);
+			if (cmd) {
+				command_done(mosq, dev, cmd, code);
+				command_pump(mosq, dev);
+			}
+			return;
+		case PROTO_ERROR:
 		case PROTO_ST_TIMEOUT:
 		case PROTO_DEVICE:
 			return;
@@ -240,13 +1153,11 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 			if (dev->type == DEVICE_TYPE_NODE) {
 				// Message from a serial device
 				if (dev->md_deps->type == MODULE_SERIAL && bridge.serial_ready) {
-					snprintf(gbuf, GBUF_SIZE, "%s%s,%d", SERIAL_INIT_MSG, dev->id, PROTO_GET_MODULES);
-					serialport_printlf(sd, gbuf);
+					serial_record(NULL, "sd", dev->id, PROTO_GET_MODULES);
 				}
 				// Message from a MQTT device
 				else if (dev->md_deps->type == MODULE_MQTT) {
-					snprintf(gbuf, GBUF_SIZE, "%s,%d", bridge.id, PROTO_GET_MODULES);
-					mqtt_publish(mosq, dev->topic, gbuf);
+					mqtt_publish_record(mosq, dev->topic, false, "sd", bridge.id, PROTO_GET_MODULES);
 					return;
 				}
 			}
@@ -255,8 +1166,8 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 			// Message from a MQTT device
 			if (dev->md_deps->type == MODULE_MQTT) {
 				for (md = bridge.module; md != NULL; md = md->next) {
-					snprintf(gbuf, GBUF_SIZE, "%s,%d,%s,%s,%d", bridge.id, PROTO_MODULE, md->id, md->device, md->enabled);
-					mqtt_publish(mosq, dev->topic, gbuf);
+					mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdssb"
+						, bridge.id, PROTO_MODULE, md->id, md->device, md->enabled);
 				}
 			}
 			return;
@@ -265,12 +1176,39 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 			if (dev->md_deps->type == MODULE_MQTT) {
 				for (i = 0; i < bridge.devices_len; i++) {
 					target_dev = &bridge.devices[i];
-					snprintf(gbuf, GBUF_SIZE, "%s,%d,%s,%d,%d"
+					mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdsdd"
 						, bridge.id, PROTO_DEVICE, target_dev->id, target_dev->modules, target_dev->alive);
-					mqtt_publish(mosq, dev->topic, gbuf);
 				}
 			}
 			return;
+		case PROTO_GET_STATE:
+			// Message from a MQTT device, optionally followed by a device id
+			if (dev->md_deps->type == MODULE_MQTT) {
+				for (md = bridge.module; md != NULL; md = md->next) {
+					if (!md->updated)
+						continue;
+					if (*msg && strcmp(msg, md->device))
+						continue;
+					mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdsls"
+						, bridge.id, PROTO_MD_STATE, md->id, (long long)md->updated, md->value);
+				}
+			}
+			return;
+		case PROTO_SERIAL_MODE:
+			// Framing is per port: the reply still goes out in the current framing,
+			// both sides use the agreed one for everything after it.
+			if (dev->md_deps->type != MODULE_SERIAL || !bridge.serial_ready)
+				return;
+			if (!getInt(&msg, &code))
+				return;
+			if (code != SERIAL_FRAMING_COBS || config.serial.framing != SERIAL_FRAMING_COBS)
+				code = SERIAL_FRAMING_ASCII;
+			serial_record(NULL, "sdd", dev->id, PROTO_SERIAL_MODE, code);
+			serial_set_framing(code);
+			return;
+		case PROTO_MD_BATCH:
+			module_batch(mosq, dev, msg);
+			return;
 		case PROTO_SAVE_DEVICE:
 			target_dev = device_get(&bridge, msg);
 			if (!target_dev)
@@ -279,7 +1217,12 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 				printf("Saving device:\n");
 				device_print_device(target_dev);
 			}
-			device_save(&bridge, config.devices_folder, target_dev);
+			if (!config.registry_file && !config.devices_folder) {
+				if (config.debug > 1) printf("No devices_folder to save the device.\n");
+				return;
+			}
+			if (bridge_save_devices(&target_dev, 1) == -1)
+				run = 0;
 			return;
 	}
 
@@ -299,6 +1242,7 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 				run = 0;
 				return;
 			}
+			device_changed(dev, device_get_module(&bridge, md_id));
 			if (config.debug > 1) {
 				md = device_get_module(&bridge, md_id);
 				printf("New Module:\n");
@@ -308,11 +1252,20 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 		return;
 	}
 
+	if (code == PROTO_GET_HISTORY) {
+		// Message from a MQTT device, the module may not be loaded yet
+		if (dev->md_deps->type == MODULE_MQTT)
+			history_reply(mosq, dev, md_id, msg);
+		return;
+	}
+
 	if (!md)
 		return;
 	target_dev = device_get(&bridge, md->device);
 	if (!target_dev) {
 		fprintf(stderr, "Error: Orphan module.\n");
+		shm_clear(&latest, md);
+		history_forget(&history, md);
 		device_remove_module(&bridge, md_id);
 		return;
 	}
@@ -321,15 +1274,14 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 		case PROTO_GET_MODULE:
 			// Message from a MQTT device
 			if (dev->md_deps->type == MODULE_MQTT) {
-				snprintf(gbuf, GBUF_SIZE, "%s,%d,%s,%s,%d", bridge.id, PROTO_MODULE, md->id, md->device, md->enabled);
-				mqtt_publish(mosq, dev->topic, gbuf);
+				mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdssb"
+					, bridge.id, PROTO_MODULE, md->id, md->device, md->enabled);
 			}
 			return;
 		case PROTO_MD_GET_TOPIC:
 			// Message from a MQTT device
 			if (dev->md_deps->type == MODULE_MQTT) {
-				snprintf(gbuf, GBUF_SIZE, "%s,%d,%s,%s", bridge.id, PROTO_MD_TOPIC, md->id, md->topic);
-				mqtt_publish(mosq, dev->topic, gbuf);
+				mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdss", bridge.id, PROTO_MD_TOPIC, md->id, md->topic);
 			}
 			return;
 		case PROTO_MD_SET_TOPIC:
@@ -340,23 +1292,53 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 				return;
 			}
 			if (code == 0) {		// Module topic changed
-				snprintf(gbuf, GBUF_SIZE, "%d,%s,%s", PROTO_MD_TOPIC, md->id, md->topic);
-				mqtt_publish(mosq, bridge.status_topic, gbuf);
+				device_changed(target_dev, md);
+				mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dss", PROTO_MD_TOPIC, md->id, md->topic);
 			}
+			local_record(client, "dss", PROTO_MD_TOPIC, md->id, md->topic);
+			return;
+		case PROTO_MD_GET_QOS:
+			// Message from a MQTT device
+			if (dev->md_deps->type == MODULE_MQTT) {
+				mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdsdb"
+					, bridge.id, PROTO_MD_QOS, md->id, md->qos, md->retain);
+			}
+			return;
+		case PROTO_MD_SET_QOS:
+		case PROTO_MD_QOS:
+			// qos of -1 goes back to the mqtt_qos default, getInt only reads positive numbers
+			if (!strncmp(msg, "-1,", 3)) {
+				msg += 3;
+				qos = MODULE_QOS_DEFAULT;
+			} else if (!getInt(&msg, &qos)) {
+				if (config.debug > 1) printf("Invalid qos - code: %d\n", code);
+				return;
+			}
+			if (!getInt(&msg, &retain)) {
+				if (config.debug > 1) printf("Invalid retain - code: %d\n", code);
+				return;
+			}
+			if (!device_set_md_qos(md, qos, retain)) {		// Module qos changed
+				device_changed(target_dev, md);
+				mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dsdb"
+					, PROTO_MD_QOS, md->id, md->qos, md->retain);
+			}
+			local_record(client, "dsdb", PROTO_MD_QOS, md->id, md->qos, md->retain);
 			return;
 		case PROTO_MD_RAW:
-			mqtt_publish(mosq, md->topic, msg);
+			if (md->enabled)
+				module_update(mosq, md, msg);
 			return;
 		case PROTO_MD_TO_RAW:
+			if (!md->enabled)
+				return;
 			// Target module at serial
 			if (target_dev->md_deps->type == MODULE_SERIAL && bridge.serial_ready) {
-				snprintf(gbuf, GBUF_SIZE, "%s%s,%d,%s,%s", SERIAL_INIT_MSG, target_dev->id, PROTO_MD_TO_RAW, md->id, msg);
-				serialport_printlf(sd, gbuf);
+				serial_record(md_coalesce(md) ? md->id : NULL, "sdss", target_dev->id, PROTO_MD_TO_RAW, md->id, msg);
 			}
 			// Target module at MQTT
 			else if (target_dev->md_deps->type == MODULE_MQTT) {
-				snprintf(gbuf, GBUF_SIZE, "%s,%d,%s,%s", bridge.id, PROTO_MD_TO_RAW, md->id, msg);
-				mqtt_publish(mosq, target_dev->topic, gbuf);
+				mqtt_publish_record(mosq, target_dev->topic, false, "sdss", bridge.id, PROTO_MD_TO_RAW, md->id, msg);
 			}
 			else if (!strcmp(md->device, bridge.id)) {
 				if (md->type == MODULE_SCRIPT) {
@@ -365,33 +1347,86 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 						run = 0;
 					}
 					else if (code == 1) {
-						mqtt_publish(mosq, md->topic, "0");	
+						module_update(mosq, md, "0");
 					}
 					else if (code == 0) {
 						if (strlen(gbuf) > 0) {
 							if (config.debug > 1) printf("Script output:\n-\n%s\n-\n", gbuf);
-							mqtt_publish(mosq, md->topic, gbuf);
+							module_update(mosq, md, gbuf);
 						} else {
-							mqtt_publish(mosq, md->topic, "1");
+							module_update(mosq, md, "1");
 						}
 					}
 				}
 				else if (md->type == MODULE_BANDWIDTH) {
 					if (bandwidth) {
-						if (mqtt_publish_bandwidth(mosq, md->topic) == -1)
+						if (mqtt_publish_bandwidth(mosq, md) == -1)
 							run = 0;
 					}
 				}
 				else if (md->type == MODULE_SERIAL) {
-					snprintf(gbuf, GBUF_SIZE, "%d", bridge.serial_ready);
-					mqtt_publish(mosq, md->topic, gbuf);
+					module_update(mosq, md, bridge.serial_ready ? "1" : "0");
 				}
 			}
 			return;
-		case PROTO_MD_ENABLE:			//TODO: implement
-		case PROTO_MD_GET_ENABLE:		//TODO: implement
-		case PROTO_MD_SET_ENABLE: 		//TODO: implement
-			return;
+		case PROTO_MD_TO_RAW_SEQ:
+			// "<seq>,<value>", the outcome is reported with PROTO_ACK or PROTO_NACK
+			if (!getInt(&msg, &seq)) {
+				if (config.debug > 1) printf("Invalid sequence - code: %d\n", code);
+				return;
+			}
+			if (!md->enabled)
+				code = 1;
+			else if (target_dev->md_deps->type == MODULE_SERIAL || target_dev->md_deps->type == MODULE_MQTT)
+				code = command_add(&target_dev->commands, md->id, seq, msg, md_coalesce(md), client ? client->id : 0
+					, &replaced, &replaced_origin);
+			else
+				code = 1;		// Only nodes ack commands
+			if (code == -1) {		// Memory problem
+				run = 0;
+				return;
+			}
+			if (code) {				// Module disabled, sequence in use or window full
+				mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dsd", PROTO_NACK, md->id, seq);
+				local_record(client, "dsd", PROTO_NACK, md->id, seq);
+				return;
+			}
+			if (replaced != -1) {	// Superseded before it was sent
+				if (config.debug > 1) printf("Command replaced - device: %s seq: %d\n", target_dev->id, replaced);
+				mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dsd", PROTO_NACK, md->id, replaced);
+				local_record(local_client_get(&local, replaced_origin), "dsd", PROTO_NACK, md->id, replaced);
+			}
+			command_pump(mosq, target_dev);
+			return;
+		case PROTO_MD_GET_ENABLE:
+			// Message from a MQTT device
+			if (dev->md_deps->type == MODULE_MQTT) {
+				mqtt_publish_record(mosq, dev->topic, record_binary(dev), "sdsb"
+					, bridge.id, PROTO_MD_ENABLE, md->id, md->enabled);
+			}
+			return;
+		case PROTO_MD_SET_ENABLE:
+		case PROTO_MD_ENABLE:
+			if (!getInt(&msg, &code)) {
+				if (config.debug > 1) printf("Invalid enable - code: %d\n", PROTO_MD_ENABLE);
+				return;
+			}
+			local_record(client, "dsb", PROTO_MD_ENABLE, md->id, code != 0);
+			if (device_set_md_enabled(&bridge, md, code != 0))
+				return;
+			device_changed(target_dev, md);
+			mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dsb", PROTO_MD_ENABLE, md->id, md->enabled);
+
+			// Let the node know, so that it can stop sending
+			if (target_dev == dev)
+				return;
+			if (target_dev->md_deps->type == MODULE_SERIAL && bridge.serial_ready) {
+				serial_record(NULL, "sdsb", target_dev->id, PROTO_MD_ENABLE, md->id, md->enabled);
+			}
+			else if (target_dev->md_deps->type == MODULE_MQTT) {
+				mqtt_publish_record(mosq, target_dev->topic, false, "sdsb", bridge.id, PROTO_MD_ENABLE, md->id, md->enabled);
+			}
+			return;
 		default:
 			if (config.debug > 2) printf("Bridge - code: %d - Not treated.\n", code);
 	}
@@ -400,12 +1435,10 @@ void bridge_message(struct mosquitto *mosq, int sd, struct device *dev, char *ms
 void on_mqtt_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
 	char *payload;
-	int *sd;
 	char id[DEVICE_ID_SIZE + 1];
 	struct device *dev;
 	int rc;
 
-	sd = (int *)obj;
 	payload  = (char *)msg->payload;
 
 	if (config.debug > 2) printf("MQTT - topic: %s - payload: %s\n", msg->topic, payload);
@@ -423,10 +1456,9 @@ void on_mqtt_message(struct mosquitto *mosq, void *obj, const struct mosquitto_m
 		if (config.debug > 1) printf("MQTT - Invalid device id.\n");
 		return;
 	}
-
 	dev = device_get(&bridge, id);
 	if (!dev) {
-		rc = device_load(&bridge, config.devices_folder, id);
+		rc = bridge_load_device(id);
 		if (rc == -1) {
 			run = 0;
 			return;
@@ -446,8 +1478,7 @@ void on_mqtt_message(struct mosquitto *mosq, void *obj, const struct mosquitto_m
 		if (config.debug > 1) printf("New device:\n");
 		device_print_device(dev);
 		if (dev->type == DEVICE_TYPE_NODE) {
-			snprintf(gbuf, GBUF_SIZE, "status/%s", dev->id);
-			rc = mosquitto_subscribe(mosq, NULL, gbuf, config.mqtt_qos);
+			rc = mosquitto_subscribe(mosq, NULL, device_topic("status/", dev->id), config.mqtt_qos);
 			if (rc) {
 				fprintf(stderr, "MQTT - Subscribe ERROR: %s\n", mosquitto_strerror(rc));
 				run = 0;
@@ -459,24 +1490,232 @@ void on_mqtt_message(struct mosquitto *mosq, void *obj, const struct mosquitto_m
 	} else
 		dev->alive = ALIVE_CNT;
 
-	bridge_message(mosq, *sd, dev, payload);
+	// Only after alive was refreshed, a node can be sending nothing else
+	if (md_dropped(payload))
+		return;
+	bridge_message(mosq, dev, NULL, payload);
+}
+
+// Message from a local client. Subscribing sends the last known
+// state right away, module commands go through bridge_message().
+void local_message(struct mosquitto *mosq, struct local_client *client, char *msg)
+{
+	char md_id[DEVICE_MD_ID_SIZE + 1];
+	struct module *md;
+	char *ptr = msg;
+	int code;
+
+	if (config.debug > 2) printf("Local - message: %s\n", msg);
+
+	if (!getInt(&ptr, &code))
+		return;
+	if (code != PROTO_LOCAL_SUB && code != PROTO_LOCAL_UNSUB) {
+		bridge_message(mosq, NULL, client, msg);
+		return;
+	}
+
+	if (!strcmp(ptr, "*")) {
+		local_subscribe(client, "*", code == PROTO_LOCAL_SUB);
+		if (code == PROTO_LOCAL_SUB) {
+			for (md = bridge.module; md != NULL; md = md->next)
+				local_reading(client, md);
+		}
+		return;
+	}
+	if (!getString(&ptr, md_id, DEVICE_MD_ID_SIZE, ',') || !device_isValid_md_id(md_id))
+		return;
+	if (local_subscribe(client, md_id, code == PROTO_LOCAL_SUB)) {
+		if (config.debug > 1) printf("Local - too many subscriptions.\n");
+		return;
+	}
+	md = device_get_module(&bridge, md_id);
+	if (md && code == PROTO_LOCAL_SUB)
+		local_reading(client, md);
+}
+
+// Local socket events, fds starts with the listening socket followed by
+// the clients, as set up for poll()
+void local_step(struct mosquitto *mosq, struct pollfd *fds, int nfds)
+{
+	char buf[LOCAL_MSG_SIZE];
+	struct local_client *client;
+	int i, n;
+
+	for (n = 1; n < nfds; n++) {
+		if (!(fds[n].revents & (POLLIN | POLLERR | POLLHUP)))
+			continue;
+		// Clients can be dropped while handling the others
+		for (i = 0; i < LOCAL_CLIENTS && local.clients[i].fd != fds[n].fd; i++);
+		if (i == LOCAL_CLIENTS)
+			continue;
+		client = &local.clients[i];
+		while (local_recv(&local, client, buf, LOCAL_MSG_SIZE) > 0)
+			local_message(mosq, client, buf);
+	}
+
+	if (fds[0].revents & POLLIN) {
+		client = local_accept(&local);
+		if (client && config.debug > 1) printf("Local - new client.\n");
+	}
+}
+
+// Resolve the device of a serial message and dispatch it.
+// Returns 0 when the message was invalid.
+int serial_message(struct mosquitto *mosq, char *md_id, char *id, char *msg)
+{
+	struct device *dev;
+	int rc;
+
+	if (!device_isValid_id(id)) {
+		if (config.debug > 1) printf("Serial - Invalid device id.\n");
+		return 0;
+	}
+	dev = device_get(&bridge, id);
+	if (!dev) {
+		rc = bridge_load_device(id);
+		if (rc == -1) {
+			run = 0;
+			return 1;
+		}
+		if (rc) {
+			rc = device_add_dev(&bridge, id, md_id);
+			if (rc == -1) {
+				run = 0;
+				return 1;
+			}
+			if (rc) {
+				if (config.debug > 2) printf("Serial - Failed to add device.\n");
+				return 1;
+			}
+		}
+		dev = device_get(&bridge, id);
+		if (config.debug > 1) {
+			printf("New device:\n");
+			device_print_device(dev);
+		}
+		if (config.serial.poll && poll_add(&polls, id, config.serial.poll) == -1) {
+			run = 0;
+			return 1;
+		}
+	} else
+		dev->alive = ALIVE_CNT;
+
+	// The polled node gives the bus back with PROTO_ST_ALIVE
+	if (polls.state == POLL_WAITING && !strcmp(polls.current->id, id)) {
+		polls.heard = true;
+		if (atoi(msg) == PROTO_ST_ALIVE)
+			poll_done(&polls, getMillis());
+	}
+
+	// Only after alive was refreshed, a node can be sending nothing else
+	if (md_dropped(msg))
+		return 1;
+	bridge_message(mosq, dev, NULL, msg);
+	return 1;
+}
+
+// Binary frame, COBS encoded: kind, device id, opcode, comma separated fields, CRC-16.
+// Turned back into the "<code>,<fields>" form used by bridge_message().
+int serial_frame_in(struct mosquitto *mosq, char *md_id, uint8_t *frame, int len)
+{
+	uint8_t data[SERIAL_MAX_BUF];
+	char id[DEVICE_ID_SIZE + 1];
+	char msg[SERIAL_MAX_BUF + 4];
+	struct fmt f;
+	int n;
+
+	n = serial_cobs_decode(frame, len, data, sizeof(data));
+	if (n < 3 || serial_crc16(data, n - 2) != ((data[n - 2] << 8) | data[n - 1])) {
+		if (config.debug > 1) printf("Serial - Invalid frame.\n");
+		serial_bad_frame();
+		return 0;
+	}
+	bridge.serial_bad_frames = 0;
+	n -= 2;
+
+	if (data[0] == SERIAL_FRAME_DEBUG) {
+		if (config.debug) printf("Debug: %.*s\n", n - 1, (char *)&data[1]);
+		return 1;
+	}
+	if (data[0] != SERIAL_FRAME_MSG || n < 2 + DEVICE_ID_SIZE) {
+		if (config.debug > 1) printf("Unknown serial data.\n");
+		return 0;
+	}
+
+	memcpy(id, &data[1], DEVICE_ID_SIZE);
+	id[DEVICE_ID_SIZE] = 0;
+
+	fmt_init(&f, msg, sizeof(msg));
+	fmt_int(&f, data[1 + DEVICE_ID_SIZE]);
+	if (n > 2 + DEVICE_ID_SIZE) {
+		fmt_char(&f, ',');
+		fmt_mem(&f, (char *)&data[2 + DEVICE_ID_SIZE], n - 2 - DEVICE_ID_SIZE);
+	}
+	if (fmt_end(&f) == -1)
+		return 0;
+
+	if (config.debug > 2) printf("Serial - frame: %s,%s\n", id, msg);
+	return serial_message(mosq, md_id, id, msg);
+}
+
+// One "@M,<device id>,<code>,<fields>" or "@D,<text>" line, without the eolchar.
+// Returns len, or 0 when the line was invalid.
+int serial_line_in(struct mosquitto *mosq, char *md_id, char *line, int len)
+{
+	char id[DEVICE_ID_SIZE + 1];
+	char *buf_p;
+
+	if (config.debug > 3) printf("Serial - size:%d, serial_buf:%s\n", len, line);
+	if (len < SERIAL_INIT_LEN) {	// We need at least SERIAL_INIT_LEN to count as a valid command
+		if (config.debug > 1) printf("Invalid serial input.\n");
+		return 0;
+	}
+
+	buf_p = &line[SERIAL_INIT_LEN];
+
+	// Serial debug
+	if (!strncmp(line, SERIAL_INIT_DEBUG, SERIAL_INIT_LEN)) {
+		if (config.debug) printf("Debug: %s\n", buf_p);
+		return len;
+	}
+	else if (!strncmp(line, SERIAL_INIT_MSG, SERIAL_INIT_LEN)) {
+		if (config.debug > 2) printf("Serial - message: %s\n", line);
+
+		if (getString(&buf_p, id, DEVICE_ID_SIZE, ',') != DEVICE_ID_SIZE) {
+			if (config.debug > 1) printf("Serial - Invalid data.\n");
+			return 0;
+		}
+		if (!serial_message(mosq, md_id, id, buf_p))
+			return 0;
+	} else {
+		if (config.debug > 1) printf("Unknown serial data.\n");
+	}
+	return len;
+}
+
+// While in COBS framing: does the buffer hold a whole ASCII line?
+// A frame can't start like one, its device id has no comma.
+bool serial_ascii_line(char *buf, int len)
+{
+	if (len <= SERIAL_INIT_LEN)
+		return false;
+	if (strncmp(buf, SERIAL_INIT_MSG, SERIAL_INIT_LEN) && strncmp(buf, SERIAL_INIT_DEBUG, SERIAL_INIT_LEN))
+		return false;
+	return memchr(buf, eolchar, len) != NULL;
 }
 
 int serial_in(int sd, struct mosquitto *mosq, char *md_id)
 {
 	static char serial_buf[SERIAL_MAX_BUF];
 	static int buf_len = 0;
-	char *buf_p;
-	char id[DEVICE_ID_SIZE + 1];
-	struct device *dev;
-	int rc, sread;
+	char *buf_p, *eol;
+	char until;
+	int sread, rc = 0;
 
-	if (buf_len)
-		buf_p = &serial_buf[buf_len - 1];
-	else
-		buf_p = &serial_buf[0];
+	buf_p = &serial_buf[buf_len];
+	until = bridge.serial_framing == SERIAL_FRAMING_COBS ? 0 : eolchar;
 
-	sread = serialport_read_until(sd, buf_p, eolchar, SERIAL_MAX_BUF - buf_len, config.serial.timeout);
+	sread = serialport_read_until(sd, buf_p, until, SERIAL_MAX_BUF - buf_len, config.serial.timeout);
 	if (sread == -1) {
 		fprintf(stderr, "Serial - Read Error.\n");
 		return -1;
@@ -486,79 +1725,45 @@ int serial_in(int sd, struct mosquitto *mosq, char *md_id)
 
 	buf_len += sread;
 
-	if (serial_buf[buf_len - 1] == eolchar) {
+	// The node is back to ASCII, without waiting for the delimiter that
+	// never comes. Handle every whole line, keep the rest for the next read.
+	if (bridge.serial_framing == SERIAL_FRAMING_COBS && serial_ascii_line(serial_buf, buf_len)) {
+		if (config.debug > 1) printf("Serial - ASCII line in COBS framing.\n");
+		serial_set_framing(SERIAL_FRAMING_ASCII);
+		while ((eol = memchr(serial_buf, eolchar, buf_len))) {
+			*eol = 0;
+			sread = eol - serial_buf;
+			if (serial_line_in(mosq, md_id, serial_buf, sread))
+				rc = sread;
+			buf_len -= sread + 1;
+			memmove(serial_buf, eol + 1, buf_len);
+		}
+		return rc;
+	}
+
+	if (serial_buf[buf_len - 1] == until) {
 		serial_buf[buf_len - 1] = 0;		//replace eolchar
 		buf_len--;					// eolchar was counted, decreasing 1
-		if (config.debug > 3) printf("Serial - size:%d, serial_buf:%s\n", buf_len, serial_buf);
-		if (buf_len < SERIAL_INIT_LEN) {	// We need at least SERIAL_INIT_LEN to count as a valid command
-			if (config.debug > 1) printf("Invalid serial input.\n");
-			buf_len = 0;
-			return 0;
-		}
 		sread = buf_len;	// for return
 		buf_len = 0;		// reseting for the next input
 
-		buf_p = &serial_buf[SERIAL_INIT_LEN];
-
-		// Serial debug
-		if (!strncmp(serial_buf, SERIAL_INIT_DEBUG, SERIAL_INIT_LEN)) {
-			if (config.debug) printf("Debug: %s\n", buf_p);
-			return sread;
-		}
-		else if (!strncmp(serial_buf, SERIAL_INIT_MSG, SERIAL_INIT_LEN)) {
-			if (config.debug > 2) printf("Serial - message: %s\n", serial_buf);
-
-			if (getString(&buf_p, id, DEVICE_ID_SIZE, ',') != DEVICE_ID_SIZE) {
-				if (config.debug > 1) printf("Serial - Invalid data.\n");
-				return 0;
-			}
-
-			if (!device_isValid_id(id)) {
-				if (config.debug > 1) printf("Serial - Invalid device id.\n");
-				return 0;
-			}
+		if (bridge.serial_framing == SERIAL_FRAMING_COBS)
+			return serial_frame_in(mosq, md_id, (uint8_t *)serial_buf, sread) ? sread : 0;
 
-			dev = device_get(&bridge, id);
-			if (!dev) {
-				rc = device_load(&bridge, config.devices_folder, id);
-				if (rc == -1) {
-					run = 0;
-					return sread;
-				}
-				if (rc) {
-					rc = device_add_dev(&bridge, id, md_id);
-					if (rc == -1) {
-						run = 0;
-						return sread;
-					}
-					if (rc) {
-						if (config.debug > 2) printf("Serial - Failed to add device.\n");
-						return sread;
-					}
-				}
-				dev = device_get(&bridge, id);
-				if (config.debug > 1) {
-					printf("New device:\n");
-					device_print_device(dev);
-				}
-			} else
-				dev->alive = ALIVE_CNT;
-			bridge_message(mosq, sd, dev, buf_p);
-		} else {
-			if (config.debug > 1) printf("Unknown serial data.\n");
-		}
-		return sread;
+		return serial_line_in(mosq, md_id, serial_buf, sread);
 	}
 	else if (buf_len == SERIAL_MAX_BUF) {
 		if (config.debug > 1) printf("Serial buffer full.\n");
 		buf_len = 0;
+		if (bridge.serial_framing == SERIAL_FRAMING_COBS)
+			serial_bad_frame();
 	} else {
 		if (config.debug > 1) printf("Serial chunked.\n");
 	}
 	return 0;
 }
 
-void signal_usr(int sd, struct mosquitto *mosq)
+void signal_usr(struct mosquitto *mosq)
 {
 	struct device *md_dev;
 	struct module *md;
@@ -582,34 +1787,236 @@ void signal_usr(int sd, struct mosquitto *mosq)
 		md_dev = device_get(&bridge, md->device);
 		if (!md_dev) {
 			fprintf(stderr, "Error: Orphan module.\n");
+			shm_clear(&latest, md);
+			history_forget(&history, md);
 			device_remove_module(&bridge, md_id);
 			user_signal = 0;
 			return;
 		}
 		if (md_dev->md_deps->type == MODULE_SERIAL && bridge.serial_ready) {
-				snprintf(gbuf, GBUF_SIZE, "%s%s,%d,%s", SERIAL_INIT_MSG, md_dev->id, PROTO_MD_RAW, md->id);
-				serialport_printlf(sd, gbuf);
+				serial_record(NULL, "sds", md_dev->id, PROTO_MD_RAW, md->id);
 		}
 
-		if (connected)
-			mqtt_publish(mosq, md->topic, "1");
+		module_update_local(mosq, md, "1");
 	}
 	user_signal = 0;
 }
 
+int serial_open(void)
+{
+	char *port;
+	int fd;
+
+	port = hotplug_find(&hotplug, config.serial.port);
+	if (!port)
+		return -1;
+
+	fd = serialport_init(port, config.serial.baudrate);
+	if (fd == -1)
+		return -1;
+	hotplug_opened(&hotplug, port);
+	if (config.serial.low_latency && serialport_low_latency(fd) == -1) {
+		if (config.debug) printf("Serial low latency not supported by the driver.\n");
+	}
+	return fd;
+}
+
+// Schedule the next open attempt, doubling the wait each time
+void serial_retry(void)
+{
+	serial_link.state = SERIAL_CLOSED;
+	serial_link.deadline = getMillis() + serial_link.backoff;
+	if (config.debug > 1) printf("Serial - retry in %d msec.\n", serial_link.backoff);
+
+	serial_link.backoff *= 2;
+	if (serial_link.backoff > SERIAL_BACKOFF_MAX)
+		serial_link.backoff = SERIAL_BACKOFF_MAX;
+}
+
+// Serial port state machine: closed -> opening -> settling -> ready.
+// Never blocks, the main loop keeps serving MQTT while the port recovers.
+void serial_step(struct mosquitto *mosq)
+{
+	struct module *md;
+	long long now;
+
+	if (serial_link.state == SERIAL_READY)
+		return;
+
+	now = getMillis();
+	if (now < serial_link.deadline)
+		return;
+
+	switch (serial_link.state) {
+		case SERIAL_CLOSED:
+			serial_link.state = SERIAL_OPENING;
+			// no break here is purposeful
+		case SERIAL_OPENING:
+			if (config.debug > 1) printf("Trying to open serial port.\n");
+			serial_link.fd = serial_open();
+			if (serial_link.fd == -1) {
+				fprintf(stderr, "Couldn't open serial port.\n");
+				serial_retry();
+				return;
+			}
+			serial_link.state = SERIAL_SETTLING;
+			serial_link.deadline = now + SERIAL_SETTLE_MSECS;
+			return;
+		case SERIAL_SETTLING:
+			serialport_flush(serial_link.fd);		// Drop what arrived while the node was booting
+			serial_link.state = SERIAL_READY;
+			bridge.serial_ready = true;
+			if (config.debug) printf("Serial ready.\n");
+
+			md = device_get_module(&bridge, MODULE_SERIAL_ID);
+			if (md)
+				module_update_local(mosq, md, "1");		// Serial is up message
+			return;
+	}
+}
+
 void serial_hang(struct mosquitto *mosq)
 {
 	struct module *md;
 
+	if (serial_link.fd != -1) {
+		serialport_close(serial_link.fd);
+		serial_link.fd = -1;
+	}
+	serial_retry();
+	poll_reset(&polls);
+
 	bridge.serial_ready = false;
 	bridge.serial_alive = 0;
+	serial_set_framing(SERIAL_FRAMING_ASCII);
+	serial_queue_clear(&serial_out);
+
+	md = device_get_module(&bridge, MODULE_SERIAL_ID);
+	if (md) {
+		module_update_local(mosq, md, "0");		// Serial is down message
+	}
+}
+
+// Drop the port as soon as it is unplugged and reopen it when it is back
+void serial_hotplug(struct mosquitto *mosq)
+{
+	int rc;
+
+	rc = hotplug_poll(&hotplug);
+	if (!rc)
+		return;
+
+	if ((rc & HOTPLUG_REMOVE) && serial_link.fd != -1) {
+		if (config.debug > 1) printf("Serial - port removed.\n");
+		serial_hang(mosq);
+	}
+
+	if ((rc & HOTPLUG_ADD) && serial_link.state == SERIAL_CLOSED) {
+		if (config.debug > 1) printf("Serial - port added.\n");
+		serial_link.backoff = SERIAL_BACKOFF_MIN;
+		serial_link.deadline = getMillis() + SERIAL_HOTPLUG_MSECS;
+	}
+}
+
+// Polling mode: the bridge owns the bus and hands it to one node at a time.
+// Queued commands only go out while no node holds the bus.
+void serial_poll(void)
+{
+	struct poll_node *node;
+	long long now;
+
+	if (!config.serial.poll || !bridge.serial_ready)
+		return;
+
+	now = getMillis();
+	switch (polls.state) {
+		case POLL_IDLE:
+			if (serial_out.count)
+				return;
+			node = poll_due(&polls, now);
+			if (!node)
+				return;
+			if (serial_record(NULL, "sd", node->id, PROTO_POLL))
+				return;
+			polls.current = node;
+			polls.heard = false;
+			polls.state = POLL_SENDING;
+			polls.polls++;
+			return;
+		case POLL_SENDING:
+			if (serial_out.count)
+				return;
+			polls.state = POLL_WAITING;
+			polls.deadline = now + config.serial.poll_timeout;
+			return;
+		case POLL_WAITING:
+			if (now < polls.deadline)
+				return;
+			if (!polls.heard && config.debug > 2) printf("Serial poll timeout - device: %s\n", polls.current->id);
+			poll_done(&polls, now);
+			return;
+	}
+}
+
+// Poll a saved device if it's a serial node
+int serial_poll_saved(char *id)
+{
+	struct device *dev;
+	int rc;
+
+	dev = device_get(&bridge, id);
+	if (!dev) {
+		rc = bridge_load_device(id);
+		if (rc)
+			return rc == -1 ? -1 : 0;
+		dev = device_get(&bridge, id);
+	}
+	if (dev->md_deps->type == MODULE_SERIAL && poll_add(&polls, dev->id, config.serial.poll) == -1)
+		return -1;
+
+	return 0;
+}
+
+// Polling mode: poll the configured nodes and every saved serial node
+int serial_poll_load(void)
+{
+	struct poll_device *pd;
+	struct dirent *ent;
+	DIR *dir;
+	int i;
+
+	for (i = 0; i < config.serial.poll_devices_len; i++) {
+		pd = &config.serial.poll_devices[i];
+		if (poll_add(&polls, pd->id, pd->interval ? pd->interval : config.serial.poll) == -1)
+			return -1;
+	}
+
+	if (config.registry_file) {
+		for (i = 0; i < registry.len; i++) {
+			if (serial_poll_saved(registry.entries[i].id) == -1)
+				return -1;
+		}
+		return 0;
+	}
 
-	if (connected) {
-		md = device_get_module(&bridge, MODULE_SERIAL_ID);
-		if (md) {
-			mqtt_publish(mosq, md->topic, "0");		// Serial is down message
+	if (!config.devices_folder)
+		return 0;
+	dir = opendir(config.devices_folder);
+	if (!dir) {
+		fprintf(stderr, "Error: Can't open devices_folder: %s\n", strerror(errno));
+		return 0;
+	}
+	while ((ent = readdir(dir))) {
+		if (!device_isValid_id(ent->d_name))
+			continue;
+		if (serial_poll_saved(ent->d_name) == -1) {
+			closedir(dir);
+			return -1;
 		}
 	}
+	closedir(dir);
+
+	return 0;
 }
 
 void print_usage(char *prog_name)
@@ -620,11 +2027,14 @@ void print_usage(char *prog_name)
 
 int main(int argc, char *argv[])
 {
-	int sd = -1;
 	char *conf_file = NULL;
 	struct mosquitto *mosq;
 	struct module *md;
 	struct device *dev;
+	char *payload;
+	long long autosave_at;
+	struct pollfd fds[4 + LOCAL_CLIENTS];
+	int nfds, mqtt_fd, local_fds;
 	int rc;
 	int i;
 	
@@ -672,9 +2082,17 @@ int main(int argc, char *argv[])
 	}
 	if (device_init(&bridge, config.id) == -1)
 		return 1;
+	bridge.policies = config.md_policies;
+	bridge.policies_len = config.md_policies_len;
+	bridge.formats = config.md_formats;
+	bridge.formats_len = config.md_formats_len;
+	codec_init();
+
+	if (alias_init(&aliases, config.mqtt_version == MQTT_PROTOCOL_V5 ? config.mqtt_topic_aliases : 0) == -1)
+		return 1;
 
 	mosquitto_lib_init();
-	mosq = mosquitto_new(config.id, true, NULL);
+	mosq = mosquitto_new(config.id, !config.persistent_session, NULL);
 	if(!mosq){
 		fprintf(stderr, "Error creating mqtt instance.\n");
 		switch(errno){
@@ -687,12 +2105,21 @@ int main(int argc, char *argv[])
 		}
 		return 1;
 	}
-	snprintf(gbuf, GBUF_SIZE, "%d", PROTO_ST_TIMEOUT);
-	mosquitto_will_set(mosq, bridge.status_topic, strlen(gbuf), gbuf, config.mqtt_qos, MQTT_RETAIN);
-	mosquitto_connect_callback_set(mosq, on_mqtt_connect);
+	if (config.mqtt_version != MQTT_PROTOCOL_V311) {
+		rc = mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, config.mqtt_version);
+		if (rc) {
+			fprintf(stderr, "Error: MQTT protocol version %d: %s\n", config.mqtt_version, mosquitto_strerror(rc));
+			return 1;
+		}
+	}
+	payload = record_format(record_binary(NULL), &rc, "d", PROTO_ST_TIMEOUT);
+	mosquitto_will_set(mosq, bridge.status_topic, rc, payload, config.mqtt_qos, MQTT_RETAIN);
+	if (config.mqtt_version == MQTT_PROTOCOL_V5)
+		mosquitto_connect_v5_callback_set(mosq, on_mqtt_connect_v5);
+	else
+		mosquitto_connect_with_flags_callback_set(mosq, on_mqtt_connect);
 	mosquitto_disconnect_callback_set(mosq, on_mqtt_disconnect);
 	mosquitto_message_callback_set(mosq, on_mqtt_message);
-	mosquitto_user_data_set(mosq, &sd);
 
 	if (config.debug > 1) printf("Subscribe topic: %s\n", bridge.config_topic);
 
@@ -726,9 +2153,39 @@ int main(int argc, char *argv[])
 		}
 		bandwidth = true;
 	}
+	if (config.registry_file) {
+		if (registry_open(&registry, config.registry_file, config.devices_folder) == -1)
+			return 1;
+		if (config.debug) printf("Registry: %d devices\n", registry.len);
+	} else if (config.devices_folder) {
+		if (saved_devices_load() == -1)
+			return 1;
+	} else if (config.autosave || config.journal_file) {
+		fprintf(stderr, "autosave and journal_file need devices_folder or registry_file.\n");
+		return 1;
+	}
+	if (config.journal_file && !config.autosave)
+		config.autosave = JOURNAL_COMPACT_SECS;
+	autosave_at = getMillis() + config.autosave * 1000LL;
+
+	serial_link.state = SERIAL_CLOSED;
+	serial_link.fd = -1;
+	serial_link.backoff = SERIAL_BACKOFF_MIN;
+	hotplug.fd = -1;
+	poll_init(&polls);
+	local_init(&local);
+	shm_init(&latest);
+	history_init(&history);
+	if (config.local_socket && local_open(&local, config.local_socket, config.local_socket_mode))
+		return 1;
 	if (config.serial.port) {
-		sd = serialport_init(config.serial.port, config.serial.baudrate);
-		if( sd == -1 ) {
+		serial_queue_init(&serial_out, config.serial.baudrate, config.serial.rx_buffer, config.serial.overflow);
+		if (hotplug_init(&hotplug, config.serial.port, config.serial.usb_id))
+			return 1;
+		if (config.serial.hotplug && hotplug_watch(&hotplug) == -1)
+			fprintf(stderr, "Error: Serial hotplug not available: %s\n", strerror(errno));
+		serial_link.fd = serial_open();
+		if (serial_link.fd == -1) {
 			fprintf(stderr, "Couldn't open serial port.\n");
 			return 1;
 		} else {
@@ -737,10 +2194,12 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Failed to add serial module.\n");
 				return 1;
 			}
-			serialport_flush(sd);
-			bridge.serial_ready = true;
+			// Ready once the node finished booting, see serial_step()
+			serial_link.state = SERIAL_SETTLING;
+			serial_link.deadline = getMillis() + SERIAL_SETTLE_MSECS;
 
-			if (config.debug) printf("Serial ready.\n");
+			if (config.serial.poll && serial_poll_load() == -1)
+				return 1;
 		}
 	}
 
@@ -758,35 +2217,118 @@ int main(int argc, char *argv[])
 
 	device_print_modules(&bridge);
 
-	rc = mosquitto_connect(mosq, config.mqtt_host, config.mqtt_port, 60);
-	if (rc) {
+	// Changes that weren't saved before the last exit
+	if (config.journal_file) {
+		if (journal_open(&journal, config.journal_file))
+			return 1;
+		rc = journal_replay(&journal, replay_change);
+		if (rc == -1)
+			return 1;
+		if (config.debug) printf("Journal: %d changes\n", rc);
+		if (rc && autosave() == -1)
+			return 1;
+	}
+
+	// Devices known when the last run stopped, no need to discover them again
+	if (config.state_file) {
+		rc = state_load(&bridge, config.state_file);
+		if (rc == -1)
+			return 1;
+		if (config.debug) printf("State: %d devices\n", rc);
+	}
+
+	if (config.shm_file) {
+		if (shm_create(&latest, config.shm_file, config.shm_slots))
+			return 1;
+		for (md = bridge.module; md; md = md->next)
+			shm_update(&latest, md);
+	}
+	if (config.history_file && history_open(&history, config.history_file, config.history_modules, config.history_size))
+		return 1;
+
+	// The connection completes in the main loop, a broker that isn't up
+	// yet is retried there
+	srand(time(NULL) ^ getpid());
+	rc = mqtt_connect(mosq);
+	if (rc == MOSQ_ERR_INVAL) {
 		fprintf(stderr, "Wrong MQTT parameters. Check your config.\n");
 		return -1;
 	}
+	if (rc)
+		fprintf(stderr, "MQTT - Failed to connect: %s\n", mosquitto_strerror(rc));
 
 	alarm(1);
 
 	while (run) {
+		if (config.serial.port) {
+			serial_hotplug(mosq);
+			serial_step(mosq);
+		}
+
 		if (bridge.serial_ready) {
-			rc = serial_in(sd, mosq, MODULE_SERIAL_ID);
+			rc = serial_in(serial_link.fd, mosq, MODULE_SERIAL_ID);
 			if (rc == -1) {
 				serial_hang(mosq);
 			} else if (rc > 0) {
 				bridge.serial_alive = ALIVE_CNT;
+				serial_link.backoff = SERIAL_BACKOFF_MIN;
 			}
 		}
 
 		if (user_signal) {
 			if (config.debug > 1) printf("Signal - SIGUSR: %d\n", user_signal);
-			signal_usr(sd, mosq);
+			signal_usr(mosq);
+		}
+
+		commands_step(mosq);
+		serial_poll();
+
+		if (journal.pending && getMillis() >= journal.commit_at)
+			journal_commit(&journal);
+		if (config.autosave && getMillis() >= autosave_at) {
+			if (autosave() == -1)
+				break;
+			autosave_at = getMillis() + config.autosave * 1000LL;
 		}
 
-		rc = mosquitto_loop(mosq, -1, 1);
-		if (run && rc) {
-			if (config.debug > 2) printf("MQTT loop: %s\n", mosquitto_strerror(rc));
-			usleep(100000);	// wait 100 msec
-			mosquitto_reconnect(mosq);
+		// Nonblocking, a partially written frame is resumed on the next pass
+		if (bridge.serial_ready && polls.state != POLL_WAITING && serial_queue_flush(&serial_out, serial_link.fd) == -1)
+			serial_hang(mosq);
+
+		// Sleep until the broker, the serial port or hotplug has something,
+		// serial reads go on at full speed while the broker is away
+		nfds = 0;
+		mqtt_fd = mosquitto_socket(mosq);
+		if (mqtt_fd != -1) {
+			fds[nfds].fd = mqtt_fd;
+			fds[nfds++].events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+		}
+		if (bridge.serial_ready) {
+			fds[nfds].fd = serial_link.fd;
+			fds[nfds++].events = POLLIN;
 		}
+		if (hotplug.fd != -1) {
+			fds[nfds].fd = hotplug.fd;
+			fds[nfds++].events = POLLIN;
+		}
+		local_fds = nfds;
+		if (local.fd != -1) {
+			fds[nfds].fd = local.fd;
+			fds[nfds++].events = POLLIN;
+			for (i = 0; i < LOCAL_CLIENTS; i++) {
+				if (local.clients[i].fd == -1)
+					continue;
+				fds[nfds].fd = local.clients[i].fd;
+				fds[nfds++].events = POLLIN;
+			}
+		}
+		for (i = 0; i < nfds; i++)
+			fds[i].revents = 0;
+		if (poll(fds, nfds, serial_out.count ? 1 : LOOP_POLL_MSECS) == -1 && errno != EINTR)
+			fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+		mqtt_step(mosq, mqtt_fd != -1 ? fds[0].revents : 0);
+		if (local.fd != -1)
+			local_step(mosq, &fds[local_fds], nfds - local_fds);
 
 		if (every30s) {
 			every30s = false;
@@ -797,12 +2339,10 @@ int main(int argc, char *argv[])
 				if (dev->alive) {
 					dev->alive--;
 					if (!dev->alive) {
-						snprintf(gbuf, GBUF_SIZE, "%d,%s", PROTO_ST_TIMEOUT, dev->id);
-						mqtt_publish(mosq, bridge.status_topic, gbuf);
+						mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "ds", PROTO_ST_TIMEOUT, dev->id);
 
 						if (dev->md_deps->type == MODULE_MQTT && dev->type == DEVICE_TYPE_NODE) {
-							snprintf(gbuf, GBUF_SIZE, "status/%s", dev->id);
-							rc = mosquitto_unsubscribe(mosq, NULL, gbuf);
+							rc = mosquitto_unsubscribe(mosq, NULL, device_topic("status/", dev->id));
 							if (rc)
 								fprintf(stderr, "Error: MQTT unsubscribe returned: %s\n", mosquitto_strerror(rc));
 						}
@@ -819,19 +2359,17 @@ int main(int argc, char *argv[])
 				bridge.modules_update = false;
 
 			if (connected) {
-				snprintf(gbuf, GBUF_SIZE, "%d,%d", PROTO_ST_ALIVE, bridge.modules_len);
-				mqtt_publish(mosq, bridge.status_topic, gbuf);
+				mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "dd", PROTO_ST_ALIVE, bridge.modules_len);
 
 				if (bridge.modules_update) {
-					snprintf(gbuf, GBUF_SIZE, "%d", PROTO_ST_MODULES_UP);
-					if (mqtt_publish(mosq, bridge.status_topic, gbuf))
+					if (mqtt_publish_record(mosq, bridge.status_topic, record_binary(NULL), "d", PROTO_ST_MODULES_UP))
 						bridge.modules_update = false;
 				}
 
 				if (bandwidth) {
 					md = device_get_module(&bridge, MODULE_BANDWIDTH_ID);
 					if (md) {
-						if (mqtt_publish_bandwidth(mosq, md->topic) == -1)
+						if (mqtt_publish_bandwidth(mosq, md) == -1)
 							break;
 					}
 				}
@@ -839,35 +2377,50 @@ int main(int argc, char *argv[])
 				if (config.debug != 0) printf("MQTT Offline.\n");
 			}
 
+			if (config.serial.port && config.debug > 1) {
+				serial_queue_print_stats(&serial_out);
+				if (config.serial.poll)
+					poll_print_stats(&polls);
+			}
+			if (saved_devices.bits && config.debug > 1)
+				bloom_print_stats(&saved_devices, "Saved devices");
+			if (journal.fptr && config.debug > 1)
+				journal_print_stats(&journal);
+			if (local.fd != -1 && config.debug > 1)
+				local_print_stats(&local);
+			if (latest.header && config.debug > 1)
+				shm_print_stats(&latest);
+			if (history.header && config.debug > 1)
+				history_print_stats(&history);
+
 			if (bridge.serial_alive) {
 				bridge.serial_alive--;
 				if (!bridge.serial_alive) {
 					if (config.debug > 1) printf("Serial timeout.\n");
 					serial_hang(mosq);
 				}
-			} else {
-				if (config.serial.port && !bridge.serial_ready) {
-					if (config.debug > 1) printf("Trying to reconnect serial port.\n");
-					serialport_close(sd);
-					sd = serialport_init(config.serial.port, config.serial.baudrate);
-					if( sd == -1 )
-						fprintf(stderr, "Couldn't open serial port.\n");
-					else {
-						serialport_flush(sd);
-						bridge.serial_ready = true;
-						if (config.debug) printf("Serial reopened.\n");
-					}
-				}
 			}
 		}
-		usleep(20);
 	}
 
-	if (bridge.serial_ready) {
-		serialport_close(sd);
+	if (config.autosave)
+		autosave();
+	journal_close(&journal);
+	if (config.state_file)
+		state_save(&bridge, config.state_file);
+	if (serial_link.fd != -1) {
+		serialport_close(serial_link.fd);
 	}
+	hotplug_cleanup(&hotplug);
+	local_close(&local);
+	shm_close(&latest);
+	history_close(&history);
+	poll_cleanup(&polls);
+	registry_close(&registry);
+	bloom_cleanup(&saved_devices);
 
 	mosquitto_destroy(mosq);
+	alias_cleanup(&aliases);
 
 	mosquitto_lib_cleanup();
 	config_cleanup(&config);
@@ -30,6 +30,16 @@
 #define TOPIC_MAX_SIZE 30
 
 #define MQTT_RETAIN 0
+#define MQTT_SESSION_PRESENT 1			// CONNACK flag
+#define MQTT_KEEPALIVE 60
+#define MQTT_SESSION_EXPIRY 86400		// secs a v5 persistent session outlives the connection
+#define MQTT_BACKOFF_MIN 1000
+#define MQTT_BACKOFF_MAX 60000
+
+#define LOOP_POLL_MSECS 10				// Longest wait of the main loop, 1 with serial output queued
+
+#define ENCODING_ASCII 0
+#define ENCODING_CBOR 1
 
 #define PROTO_ERROR 0
 #define PROTO_ACK 1
@@ -53,12 +63,52 @@
 #define PROTO_GET_DEVICES 19
 #define PROTO_SAVE_DEVICE 20
 #define PROTO_REMOVE_DEVICE 21
+#define PROTO_MD_QOS 22
+#define PROTO_MD_GET_QOS 23
+#define PROTO_MD_SET_QOS 24
+#define PROTO_MD_STATE 25
+#define PROTO_GET_STATE 26
+#define PROTO_SERIAL_MODE 27
+#define PROTO_MD_TO_RAW_SEQ 28			// PROTO_MD_TO_RAW acked by the node
+#define PROTO_POLL 29					// The node owns the serial bus until PROTO_ST_ALIVE
+#define PROTO_MD_BATCH 30				// "<md_id>=<value>;<md_id>=<value>..."
+#define PROTO_LOCAL_SUB 31				// Local socket, "<md_id>" or "*" for every module
+#define PROTO_LOCAL_UNSUB 32
+#define PROTO_GET_HISTORY 33			// "<md_id>,<from>[,<to>]" in msecs since the epoch
+#define PROTO_HISTORY 34				// "<md_id>,<msecs>:<value>;...", none after the last batch
+
+struct module_policy{
+	char *match;					// Module id or module type name
+	int qos;
+	int retain;
+};
+
+struct module_format{
+	char *match;					// Module id or module type name
+	int format;
+	double scale;
+};
+
+struct poll_device{
+	char *id;
+	int interval;
+};
 
 struct bridge_serial{
 	char *port;
 	int baudrate;
 	int timeout;
 	int qos;
+	int rx_buffer;
+	int overflow;
+	int framing;
+	int low_latency;
+	int hotplug;
+	char *usb_id;
+	int poll;						// msecs, 0 lets the nodes push
+	int poll_timeout;
+	struct poll_device *poll_devices;
+	int poll_devices_len;
 };
 
 struct bridge_config{
@@ -67,12 +117,37 @@ struct bridge_config{
 	char *mqtt_host;
 	int mqtt_port;
 	int mqtt_qos;
+	int mqtt_version;
+	int mqtt_topic_aliases;
+	int mqtt_user_props;
+	int persistent_session;
+	char *state_file;
+	char *local_socket;
+	int local_socket_mode;
+	char *shm_file;
+	int shm_slots;
+	char *history_file;
+	int history_modules;
+	int history_size;
+	int encoding;
 	struct bridge_serial serial;
 	char *devices_folder;
+	char *registry_file;
+	int autosave;
+	char *journal_file;
 	char *scripts_folder;
 	char *interface;
 	char *remap_usr1;
 	char *remap_usr2;
+	struct module_policy *md_policies;
+	int md_policies_len;
+	struct module_format *md_formats;
+	int md_formats_len;
+	int batch_publish;
+	int command_window;
+	int command_timeout;
+	int command_retries;
+	unsigned long no_coalesce;		// Bitmask of module types
 };
 
 int config_parse(const char *conffile, struct bridge_config *config);
@@ -0,0 +1,132 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "poll.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+void poll_init(struct poll_table *table)
+{
+	table->nodes = NULL;
+	table->len = 0;
+	table->state = POLL_IDLE;
+	table->current = NULL;
+	table->heard = false;
+	table->deadline = 0;
+	table->polls = 0;
+	table->timeouts = 0;
+}
+
+// Add a node to the polling cycle, polled right away.
+// Returns 1 if the node is already polled.
+int poll_add(struct poll_table *table, const char *id, int interval)
+{
+	struct poll_node *nodes;
+	int i, current = -1;
+
+	for (i = 0; i < table->len; i++) {
+		if (!strcmp(table->nodes[i].id, id))
+			return 1;
+	}
+
+	if (table->current)
+		current = table->current - table->nodes;
+
+	nodes = realloc(table->nodes, sizeof(struct poll_node) * (table->len + 1));
+	if (!nodes) {
+		fprintf(stderr, "Error: No memory left.\n");
+		return -1;
+	}
+	table->nodes = nodes;
+	if (current != -1)
+		table->current = &nodes[current];
+
+	snprintf(nodes[table->len].id, DEVICE_ID_SIZE + 1, "%s", id);
+	nodes[table->len].interval = interval;
+	nodes[table->len].misses = 0;
+	nodes[table->len].next = 0;
+	table->len++;
+
+	return 0;
+}
+
+// Node most overdue for a poll, NULL if none is due yet
+struct poll_node *poll_due(struct poll_table *table, long long now)
+{
+	struct poll_node *node, *due = NULL;
+	int i;
+
+	for (i = 0; i < table->len; i++) {
+		node = &table->nodes[i];
+		if (node->next <= now && (!due || node->next < due->next))
+			due = node;
+	}
+	return due;
+}
+
+// Close the current poll and schedule the next one for that node.
+// Silent nodes are polled less and less often, down to POLL_BACKOFF_MAX.
+void poll_done(struct poll_table *table, long long now)
+{
+	struct poll_node *node = table->current;
+	long long wait;
+
+	table->state = POLL_IDLE;
+	table->current = NULL;
+	if (!node)
+		return;
+
+	if (table->heard) {
+		node->misses = 0;
+		wait = node->interval;
+	} else {
+		table->timeouts++;
+		if (node->misses < 16)
+			node->misses++;
+		wait = (long long)node->interval << node->misses;
+		if (wait > POLL_BACKOFF_MAX)
+			wait = POLL_BACKOFF_MAX > node->interval ? POLL_BACKOFF_MAX : node->interval;
+	}
+	node->next = now + wait;
+}
+
+// Abort the current poll without holding it against the node (port lost)
+void poll_reset(struct poll_table *table)
+{
+	table->state = POLL_IDLE;
+	table->current = NULL;
+}
+
+void poll_print_stats(struct poll_table *table)
+{
+	printf("Serial poll - nodes: %d, polls: %lu, timeouts: %lu\n", table->len, table->polls, table->timeouts);
+}
+
+void poll_cleanup(struct poll_table *table)
+{
+	free(table->nodes);
+	poll_init(table);
+}
@@ -0,0 +1,63 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef POLL_H
+#define POLL_H
+
+#include "device.h"
+
+#define POLL_IDLE 0
+#define POLL_SENDING 1					// Request queued, not written yet
+#define POLL_WAITING 2					// Bus handed to the node
+
+#define POLL_TIMEOUT 100				// msecs
+#define POLL_BACKOFF_MAX 60000			// msecs, slowest rate for a silent node
+
+struct poll_node {
+	char id[DEVICE_ID_SIZE + 1];
+	int interval;					// msecs
+	int misses;						// Polls in a row without an answer
+	long long next;
+};
+
+struct poll_table {
+	struct poll_node *nodes;
+	int len;
+	int state;
+	struct poll_node *current;
+	bool heard;						// The current node said something
+	long long deadline;
+	unsigned long polls;
+	unsigned long timeouts;
+};
+
+void poll_init(struct poll_table *);
+int poll_add(struct poll_table *, const char *, int);
+struct poll_node *poll_due(struct poll_table *, long long);
+void poll_done(struct poll_table *, long long);
+void poll_reset(struct poll_table *);
+void poll_print_stats(struct poll_table *);
+void poll_cleanup(struct poll_table *);
+
+#endif
@@ -0,0 +1,366 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "registry.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Also used as the bsearch key compare, id is the first member of the entry
+static int _registry_cmp(const void *a, const void *b)
+{
+	return strcmp((const char *)a, (const char *)b);
+}
+
+static int _registry_cmp_dev(const void *a, const void *b)
+{
+	return strcmp((*(struct device **)a)->id, (*(struct device **)b)->id);
+}
+
+static void _registry_unmap(struct registry *reg)
+{
+	if (reg->map)
+		munmap(reg->map, reg->size);
+	free(reg->entries);
+	reg->map = NULL;
+	reg->size = 0;
+	reg->entries = NULL;
+	reg->len = 0;
+}
+
+// Map the snapshot and index its records.
+// Returns 1 if there's no snapshot yet.
+static int _registry_map(struct registry *reg)
+{
+	struct registry_entry *entry;
+	struct stat st;
+	char header[64];
+	char *p, *end, *nl;
+	int fd, version, count;
+	bool sorted = true;
+
+	_registry_unmap(reg);
+
+	fd = open(reg->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 1;
+		fprintf(stderr, "Error: Can't open registry \"%s\": %s\n", reg->path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		fprintf(stderr, "Invalid registry file: %s\n", reg->path);
+		close(fd);
+		return -1;
+	}
+	reg->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (reg->map == MAP_FAILED) {
+		fprintf(stderr, "Error: Can't map registry \"%s\": %s\n", reg->path, strerror(errno));
+		reg->map = NULL;
+		return -1;
+	}
+	reg->size = st.st_size;
+	end = reg->map + reg->size;
+
+	nl = memchr(reg->map, '\n', reg->size);
+	if (!nl || nl - reg->map >= (int)sizeof(header))
+		goto invalid;
+	memcpy(header, reg->map, nl - reg->map);
+	header[nl - reg->map] = 0;
+	if (sscanf(header, "registry,%d,%d", &version, &count) != 2 || count < 0)
+		goto invalid;
+	if (version != REGISTRY_VERSION) {
+		fprintf(stderr, "Unsupported registry version: %d\n", version);
+		_registry_unmap(reg);
+		return -1;
+	}
+
+	if ((reg->entries = malloc(sizeof(struct registry_entry) * (count ? count : 1))) == NULL) {
+		fprintf(stderr, "No memory left.\n");
+		_registry_unmap(reg);
+		return -1;
+	}
+
+	for (p = nl + 1; p < end; p = nl + 1) {
+		nl = memchr(p, '\n', end - p);
+		if (!nl)
+			nl = end;
+		if (nl - p <= 7 + DEVICE_ID_SIZE || strncmp(p, "device,", 7) || p[7 + DEVICE_ID_SIZE] != ',')
+			continue;
+
+		if (reg->len == count)
+			goto invalid;
+		if (reg->len) {
+			entry = &reg->entries[reg->len - 1];
+			entry->len = (p - reg->map) - entry->offset;
+		}
+		entry = &reg->entries[reg->len++];
+		memcpy(entry->id, p + 7, DEVICE_ID_SIZE);
+		entry->id[DEVICE_ID_SIZE] = 0;
+		entry->offset = p - reg->map;
+		if (reg->len > 1 && strcmp(entry[-1].id, entry->id) > 0)
+			sorted = false;
+	}
+	if (reg->len != count)
+		goto invalid;
+	if (reg->len) {
+		entry = &reg->entries[reg->len - 1];
+		entry->len = reg->size - entry->offset;
+	}
+	if (!sorted)
+		qsort(reg->entries, reg->len, sizeof(struct registry_entry), _registry_cmp);
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid registry file: %s\n", reg->path);
+	_registry_unmap(reg);
+	return -1;
+}
+
+// Replace the snapshot by the one written to tmp, then map it
+static int _registry_commit(struct registry *reg, FILE *fptr, char *tmp)
+{
+	if (fflush(fptr) || fsync(fileno(fptr)) || ferror(fptr)) {
+		fprintf(stderr, "Error writing registry file \"%s\": %s\n", tmp, strerror(errno));
+		fclose(fptr);
+		unlink(tmp);
+		return 1;
+	}
+	fclose(fptr);
+	if (rename(tmp, reg->path) == -1) {
+		fprintf(stderr, "Error replacing registry file \"%s\": %s\n", reg->path, strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	// The new snapshot is in place either way, map it
+	if (sync_dir(reg->path) == -1)
+		fprintf(stderr, "Error syncing registry folder \"%s\": %s\n", reg->path, strerror(errno));
+
+	return _registry_map(reg);
+}
+
+// Check that a device file starts with its device line
+static bool _registry_valid_file(char *path, char *id)
+{
+	FILE *fptr;
+	char buf[1024];
+	bool valid = false;
+
+	fptr = fopen(path, "rt");
+	if (!fptr)
+		return false;
+	while (fgets(buf, 1024, fptr)) {
+		if (buf[0] == '#' || buf[0] == 10 || buf[0] == 13)
+			continue;
+		valid = !strncmp(buf, "device,", 7) && !strncmp(&buf[7], id, DEVICE_ID_SIZE) && buf[7 + DEVICE_ID_SIZE] == ',';
+		break;
+	}
+	fclose(fptr);
+
+	return valid;
+}
+
+// Build the snapshot from the device files of folder
+static int _registry_import(struct registry *reg, char *folder)
+{
+	struct registry_entry *entries = NULL, *new_entries;
+	struct dirent *ent;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	char buf[1024];
+	FILE *fptr, *dev_fptr;
+	DIR *dir;
+	int i, len = 0;
+	char last;
+
+	dir = opendir(folder);
+	if (!dir) {
+		fprintf(stderr, "Error: Can't open devices_folder: %s\n", strerror(errno));
+		return 1;
+	}
+	while ((ent = readdir(dir))) {
+		if (!device_isValid_id(ent->d_name))
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", folder, ent->d_name);
+		if (!_registry_valid_file(path, ent->d_name)) {
+			fprintf(stderr, "Invalid device file: %s\n", ent->d_name);
+			continue;
+		}
+
+		new_entries = realloc(entries, sizeof(struct registry_entry) * (len + 1));
+		if (!new_entries) {
+			fprintf(stderr, "No memory left.\n");
+			free(entries);
+			closedir(dir);
+			return -1;
+		}
+		entries = new_entries;
+		strcpy(entries[len++].id, ent->d_name);
+	}
+	closedir(dir);
+	qsort(entries, len, sizeof(struct registry_entry), _registry_cmp);
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", reg->path);
+	fptr = fopen(tmp, "w");
+	if (!fptr) {
+		fprintf(stderr, "Error opening registry file for write \"%s\".\n", tmp);
+		free(entries);
+		return 1;
+	}
+	fprintf(fptr, "registry,%d,%d\n", REGISTRY_VERSION, len);
+	for (i = 0; i < len; i++) {
+		snprintf(path, PATH_MAX, "%s/%s", folder, entries[i].id);
+		dev_fptr = fopen(path, "rt");
+		if (!dev_fptr) {
+			fprintf(stderr, "Error opening device file \"%s\".\n", path);
+			free(entries);
+			fclose(fptr);
+			unlink(tmp);
+			return 1;
+		}
+		last = '\n';
+		while (fgets(buf, 1024, dev_fptr)) {
+			fputs(buf, fptr);
+			last = buf[strlen(buf) - 1];
+		}
+		if (last != '\n')
+			fputc('\n', fptr);
+		fclose(dev_fptr);
+	}
+	free(entries);
+
+	return _registry_commit(reg, fptr, tmp);
+}
+
+// Map the snapshot at path, created from the device files of folder
+// when missing. Returns 1 if there is neither.
+int registry_open(struct registry *reg, char *path, char *folder)
+{
+	int rc;
+
+	reg->path = path;
+	reg->map = NULL;
+	reg->size = 0;
+	reg->entries = NULL;
+	reg->len = 0;
+
+	rc = _registry_map(reg);
+	if (rc != 1 || !folder)
+		return rc;
+
+	return _registry_import(reg, folder);
+}
+
+// Same as device_load(), from the snapshot.
+// Returns 1 if the device isn't in the registry.
+int registry_load(struct registry *reg, struct bridge *bdev, char *dev_id)
+{
+	struct registry_entry *entry;
+	char buf[1024];
+	char *p, *end, *nl;
+	int len, rc = 0;
+
+	if (!reg->len)
+		return 1;
+	entry = bsearch(dev_id, reg->entries, reg->len, sizeof(struct registry_entry), _registry_cmp);
+	if (!entry)
+		return 1;
+
+	p = reg->map + entry->offset;
+	end = p + entry->len;
+	for (; p < end && !rc; p += len + 1) {
+		nl = memchr(p, '\n', end - p);
+		len = nl ? nl - p : end - p;
+		if (len >= 1024) {
+			rc = 1;
+			break;
+		}
+		memcpy(buf, p, len);
+		buf[len] = 0;
+		rc = device_load_line(bdev, dev_id, buf);
+	}
+	if (rc == 1)
+		fprintf(stderr, "Invalid registry record: %s\n", dev_id);
+
+	return rc;
+}
+
+// Write a new snapshot with the current state of the devices, all at once
+int registry_save(struct registry *reg, struct bridge *bdev, struct device **devs, int len)
+{
+	struct registry_entry *entry;
+	char tmp[PATH_MAX];
+	FILE *fptr;
+	int i, d, cmp, count;
+
+	qsort(devs, len, sizeof(struct device *), _registry_cmp_dev);
+	count = reg->len;
+	for (d = 0; d < len; d++) {
+		if (!reg->len || !bsearch(devs[d]->id, reg->entries, reg->len, sizeof(struct registry_entry), _registry_cmp))
+			count++;
+	}
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", reg->path);
+	fptr = fopen(tmp, "w");
+	if (!fptr) {
+		fprintf(stderr, "Error opening registry file for write \"%s\".\n", tmp);
+		return 1;
+	}
+	fprintf(fptr, "registry,%d,%d\n", REGISTRY_VERSION, count);
+	d = 0;
+	for (i = 0; i < reg->len; i++) {
+		entry = &reg->entries[i];
+		cmp = 1;
+		while (d < len && (cmp = strcmp(devs[d]->id, entry->id)) <= 0) {
+			device_write(bdev, fptr, devs[d++], false);
+			if (!cmp)
+				break;
+		}
+		if (!cmp)
+			continue;
+		fwrite(reg->map + entry->offset, 1, entry->len, fptr);
+		if (reg->map[entry->offset + entry->len - 1] != '\n')
+			fputc('\n', fptr);
+	}
+	while (d < len)
+		device_write(bdev, fptr, devs[d++], false);
+
+	return _registry_commit(reg, fptr, tmp);
+}
+
+void registry_close(struct registry *reg)
+{
+	_registry_unmap(reg);
+}
@@ -0,0 +1,59 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+
+#include "device.h"
+
+#define REGISTRY_VERSION 1
+
+// Snapshot of every saved device in one file:
+//   registry,<version>,<devices>
+//   device,<id>,<md_deps>
+//   module,...
+// in the device file format, sorted by device id.
+
+struct registry_entry {
+	char id[DEVICE_ID_SIZE + 1];
+	size_t offset;					// "device," line of the record in the map
+	size_t len;
+};
+
+struct registry {
+	char *path;
+	char *map;						// Read only mapping of the file, NULL when empty
+	size_t size;
+	struct registry_entry *entries;	// Sorted by id
+	int len;
+};
+
+int registry_open(struct registry *, char *, char *);
+int registry_load(struct registry *, struct bridge *, char *);
+int registry_save(struct registry *, struct bridge *, struct device **, int);
+void registry_close(struct registry *);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "serial.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define SERIAL_IOV_MAX SERIAL_QUEUE_SIZE
+
+void serial_queue_init(struct serial_queue *queue, int baudrate, int rx_buffer, int overflow)
+{
+	memset(queue, 0, sizeof(struct serial_queue));
+	queue->baudrate = baudrate;
+	queue->rx_buffer = rx_buffer > 0 ? rx_buffer : SERIAL_RX_BUFFER;
+	queue->overflow = overflow;
+	queue->credit = queue->rx_buffer;
+	queue->refill = getMillis();
+}
+
+// Drops everything still waiting, used when the port goes down
+void serial_queue_clear(struct serial_queue *queue)
+{
+	queue->dropped += queue->count;
+	queue->head = 0;
+	queue->count = 0;
+	queue->offset = 0;
+	queue->credit = queue->rx_buffer;
+	queue->refill = getMillis();
+}
+
+// Queue a whole frame, returns 0 when queued or 1 when a frame was dropped
+int serial_queue_push(struct serial_queue *queue, const char *data, int len, const char *key)
+{
+	struct serial_frame *frame;
+	int i, rc = 0;
+
+	if (len <= 0 || len > SERIAL_FRAME_SIZE) {
+		queue->dropped++;
+		return 1;
+	}
+
+	// Latest wins: a frame not written yet for the same key is replaced in place
+	if (key) {
+		for (i = queue->offset ? 1 : 0; i < queue->count; i++) {
+			frame = &queue->frames[(queue->head + i) % SERIAL_QUEUE_SIZE];
+			if (!strcmp(frame->key, key)) {
+				memcpy(frame->data, data, len);
+				frame->len = len;
+				queue->coalesced++;
+				return 0;
+			}
+		}
+	}
+
+	if (queue->count == SERIAL_QUEUE_SIZE) {
+		queue->dropped++;
+		if (queue->overflow == SERIAL_DROP_NEWEST || queue->offset)
+			return 1;
+		// Drop the oldest frame, unless it is already partially written
+		queue->head = (queue->head + 1) % SERIAL_QUEUE_SIZE;
+		queue->count--;
+		rc = 1;
+	}
+
+	frame = &queue->frames[(queue->head + queue->count) % SERIAL_QUEUE_SIZE];
+	memcpy(frame->data, data, len);
+	frame->len = len;
+	snprintf(frame->key, SERIAL_KEY_SIZE, "%s", key ? key : "");
+	queue->count++;
+	queue->queued++;
+	if (queue->count > queue->max_depth)
+		queue->max_depth = queue->count;
+
+	return rc;
+}
+
+// The line moves baudrate / 10 bytes per second (8N1), never allow more
+// than the receiver buffer to be in flight.
+static void _serial_queue_refill(struct serial_queue *queue)
+{
+	long long now;
+
+	// Leave refill alone until a whole msec went by, so that frequent
+	// flushes don't lose the sub-msec part
+	now = getMillis();
+	if (now <= queue->refill)
+		return;
+
+	queue->credit += (now - queue->refill) * queue->baudrate / 10000.0;
+	queue->refill = now;
+	if (queue->credit > queue->rx_buffer)
+		queue->credit = queue->rx_buffer;
+}
+
+// Write as many queued frames as the pacing allows with a single writev.
+// Returns the number of bytes written or -1 on a write error.
+int serial_queue_flush(struct serial_queue *queue, int fd)
+{
+	struct iovec iov[SERIAL_IOV_MAX];
+	struct serial_frame *frame;
+	int budget, iovcnt = 0;
+	int i, n, written;
+
+	if (!queue->count)
+		return 0;
+
+	_serial_queue_refill(queue);
+	budget = queue->credit;
+	if (budget <= 0)
+		return 0;
+
+	for (i = 0; i < queue->count && iovcnt < SERIAL_IOV_MAX && budget > 0; i++) {
+		frame = &queue->frames[(queue->head + i) % SERIAL_QUEUE_SIZE];
+		iov[iovcnt].iov_base = frame->data;
+		iov[iovcnt].iov_len = frame->len;
+		if (i == 0) {
+			iov[iovcnt].iov_base = frame->data + queue->offset;
+			iov[iovcnt].iov_len -= queue->offset;
+		}
+		if (iov[iovcnt].iov_len > budget)
+			iov[iovcnt].iov_len = budget;
+		budget -= iov[iovcnt].iov_len;
+		iovcnt++;
+	}
+
+	written = writev(fd, iov, iovcnt);
+	if (written == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("serial_queue_flush: writev");
+		return -1;
+	}
+	queue->credit -= written;
+
+	// Release the frames that went out completely, remember where the next one stopped
+	for (n = written; n > 0 && queue->count; ) {
+		frame = &queue->frames[queue->head];
+		if (n < frame->len - queue->offset) {
+			queue->offset += n;
+			queue->partial++;
+			break;
+		}
+		n -= frame->len - queue->offset;
+		queue->offset = 0;
+		queue->head = (queue->head + 1) % SERIAL_QUEUE_SIZE;
+		queue->count--;
+		queue->sent++;
+	}
+
+	return written;
+}
+
+// Consistent Overhead Byte Stuffing, the output has no zero byte so 0 can delimit frames.
+// Returns the encoded length or -1 if out is too small.
+int serial_cobs_encode(const uint8_t *in, int len, uint8_t *out, int out_size)
+{
+	int code_pos = 0, out_len = 1, i;
+	uint8_t code = 1;
+
+	if (out_size < 1)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		if (in[i]) {
+			if (out_len == out_size)
+				return -1;
+			out[out_len++] = in[i];
+			code++;
+		}
+		if (!in[i] || code == 0xFF) {
+			out[code_pos] = code;
+			code = 1;
+			if (out_len == out_size)
+				return -1;
+			code_pos = out_len++;
+		}
+	}
+	out[code_pos] = code;
+
+	return out_len;
+}
+
+// Returns the decoded length or -1 on a malformed frame
+int serial_cobs_decode(const uint8_t *in, int len, uint8_t *out, int out_size)
+{
+	int in_pos = 0, out_len = 0, i;
+	uint8_t code;
+
+	while (in_pos < len) {
+		code = in[in_pos++];
+		if (!code || in_pos + code - 1 > len)
+			return -1;
+		for (i = 1; i < code; i++) {
+			if (out_len == out_size)
+				return -1;
+			out[out_len++] = in[in_pos++];
+		}
+		if (code != 0xFF && in_pos < len) {
+			if (out_len == out_size)
+				return -1;
+			out[out_len++] = 0;
+		}
+	}
+
+	return out_len;
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t serial_crc16(const uint8_t *data, int len)
+{
+	uint16_t crc = 0xFFFF;
+	int i, bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= data[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+void serial_queue_print_stats(struct serial_queue *queue)
+{
+	printf("Serial queue - depth: %d, max depth: %d, queued: %lu, sent: %lu, dropped: %lu, partial: %lu, coalesced: %lu\n",
+		queue->count, queue->max_depth, queue->queued, queue->sent, queue->dropped, queue->partial, queue->coalesced);
+}
@@ -29,4 +29,70 @@
 #define SERIAL_INIT_DEBUG "@D,"
 #define SERIAL_INIT_MSG "@M,"
 
+#define SERIAL_FRAMING_ASCII 0
+#define SERIAL_FRAMING_COBS 1
+
+#define SERIAL_FRAME_MSG 'M'
+#define SERIAL_FRAME_DEBUG 'D'
+
+#include <stdint.h>
+
+#define SERIAL_QUEUE_SIZE 16
+#define SERIAL_FRAME_SIZE 128
+#define SERIAL_RX_BUFFER 64				// Arduino hardware serial receive buffer
+#define SERIAL_KEY_SIZE 8
+
+#define SERIAL_CLOSED 0
+#define SERIAL_OPENING 1
+#define SERIAL_SETTLING 2
+#define SERIAL_READY 3
+
+#define SERIAL_SETTLE_MSECS 2000			// Arduino resets when the port is opened
+#define SERIAL_BACKOFF_MIN 1000
+#define SERIAL_BACKOFF_MAX 60000
+#define SERIAL_HOTPLUG_MSECS 50				// Let udev set permissions and links
+
+#define SERIAL_DROP_NEWEST 0
+#define SERIAL_DROP_OLDEST 1
+
+struct serial_link {
+	int state;
+	int fd;
+	long long deadline;				// msecs, next state change
+	int backoff;					// msecs, wait before the next open retry
+};
+
+struct serial_frame {
+	char data[SERIAL_FRAME_SIZE];
+	int len;
+	char key[SERIAL_KEY_SIZE];		// Newer frames with the same key replace it, "" never
+};
+
+struct serial_queue {
+	struct serial_frame frames[SERIAL_QUEUE_SIZE];
+	int head;						// Next frame to write
+	int count;
+	int offset;						// Bytes of the head frame already written
+	int overflow;
+	int baudrate;
+	int rx_buffer;
+	double credit;					// Bytes that can be written without overrunning the receiver
+	long long refill;				// msecs, monotonic, last credit refill
+	unsigned long queued;
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long partial;
+	unsigned long coalesced;
+	int max_depth;
+};
+
+void serial_queue_init(struct serial_queue *, int, int, int);
+void serial_queue_clear(struct serial_queue *);
+int serial_queue_push(struct serial_queue *, const char *, int, const char *);
+int serial_queue_flush(struct serial_queue *, int);
+void serial_queue_print_stats(struct serial_queue *);
+int serial_cobs_encode(const uint8_t *, int, uint8_t *, int);
+int serial_cobs_decode(const uint8_t *, int, uint8_t *, int);
+uint16_t serial_crc16(const uint8_t *, int);
+
 #endif
\ No newline at end of file
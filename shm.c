@@ -0,0 +1,171 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "shm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "device.h"
+#include "utils.h"
+
+void shm_init(struct shm_table *table)
+{
+	table->header = NULL;
+	table->slots = NULL;
+	table->len = 0;
+	table->size = 0;
+	table->updates = 0;
+	table->skipped = 0;
+}
+
+// The file is reused and never shrinks, so readers that mapped it during
+// a previous run keep a valid mapping and see the new start time.
+int shm_create(struct shm_table *table, const char *path, int slots)
+{
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	size = sizeof(struct shm_header) + (size_t)slots * sizeof(struct shm_slot);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error: Can't open shm_file \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, size) == -1)) {
+		fprintf(stderr, "Error: Can't size shm_file \"%s\": %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error: Can't map shm_file \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	table->header = map;
+	table->slots = (struct shm_slot *)(table->header + 1);
+	table->len = slots;
+	table->size = size;
+
+	// Readers reject the table until the magic is back
+	__atomic_store_n(&table->header->magic, 0, __ATOMIC_RELEASE);
+	memset(table->slots, 0, size - sizeof(struct shm_header));
+	table->header->version = SHM_VERSION;
+	table->header->slots = slots;
+	table->header->slot_size = sizeof(struct shm_slot);
+	table->header->started = getMillis();
+	table->header->used = 0;
+	__atomic_store_n(&table->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static struct shm_slot *_shm_begin(struct shm_table *table, struct module *md)
+{
+	struct shm_slot *slot;
+
+	if (!table->header)
+		return NULL;
+	if (md->index >= table->len) {
+		table->skipped++;
+		return NULL;
+	}
+	slot = &table->slots[md->index];
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return slot;
+}
+
+static void _shm_end(struct shm_table *table, struct module *md, struct shm_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	if ((uint32_t)md->index >= table->header->used)
+		__atomic_store_n(&table->header->used, md->index + 1, __ATOMIC_RELEASE);
+}
+
+// Values that don't fit are cut, len keeps the full length
+void shm_update(struct shm_table *table, struct module *md)
+{
+	struct shm_slot *slot;
+	size_t len;
+
+	if (!md->value || !(slot = _shm_begin(table, md)))
+		return;
+
+	len = strlen(md->value);
+	if (strncmp(slot->id, md->id, SHM_ID_SIZE))
+		strncpy(slot->id, md->id, SHM_ID_SIZE - 1);
+	memcpy(slot->value, md->value, len < SHM_VALUE_SIZE ? len : SHM_VALUE_SIZE - 1);
+	slot->value[len < SHM_VALUE_SIZE ? len : SHM_VALUE_SIZE - 1] = 0;
+	slot->len = len;
+	slot->updated = md->updated;
+	slot->count++;
+
+	_shm_end(table, md, slot);
+	table->updates++;
+}
+
+void shm_clear(struct shm_table *table, struct module *md)
+{
+	struct shm_slot *slot;
+
+	if (!(slot = _shm_begin(table, md)))
+		return;
+
+	memset(slot->id, 0, SHM_ID_SIZE);
+	slot->value[0] = 0;
+	slot->len = 0;
+	slot->updated = 0;
+	slot->count = 0;
+
+	_shm_end(table, md, slot);
+}
+
+void shm_print_stats(struct shm_table *table)
+{
+	printf("Shared table - slots: %d, used: %u, updates: %lu, skipped: %lu\n", table->len, table->header->used, table->updates, table->skipped);
+}
+
+// The writer leaves the file in place with started at 0, so readers can
+// tell the bridge is gone
+void shm_close(struct shm_table *table)
+{
+	if (!table->header)
+		return;
+	__atomic_store_n(&table->header->started, 0, __ATOMIC_RELEASE);
+	munmap(table->header, table->size);
+	table->header = NULL;
+	table->slots = NULL;
+	table->len = 0;
+}
@@ -0,0 +1,53 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "shm_reader.h"
+
+#define SHM_SLOTS 1024
+
+// Writer side of the shared table, see shm_reader.h for the layout and
+// the readers.
+
+struct shm_table {
+	struct shm_header *header;		// NULL when not used
+	struct shm_slot *slots;
+	int len;						// Slots mapped
+	size_t size;
+	unsigned long updates;
+	unsigned long skipped;			// Module index beyond the table
+};
+
+struct module;
+
+void shm_init(struct shm_table *);
+int shm_create(struct shm_table *, const char *, int);
+void shm_update(struct shm_table *, struct module *);
+void shm_clear(struct shm_table *, struct module *);
+void shm_print_stats(struct shm_table *);
+void shm_close(struct shm_table *);
+
+#endif
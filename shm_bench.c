@@ -0,0 +1,92 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+// Read cost of the shared table, against a running bridge:
+//   shm_bench <shm_file> <module id> [reads]
+// Reads the slot of the module in a loop and reports the time per read
+// and how often a read raced the bridge writing the slot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shm_reader.h"
+
+#define BENCH_READS 10000000
+
+static long long bench_nanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct shm_reader table;
+	struct shm_value value;
+	long long start, elapsed;
+	long reads = BENCH_READS, i, failed = 0;
+	uint64_t first;
+	int index;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <shm_file> <module id> [reads]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		reads = atol(argv[3]);
+	if (reads < 1)
+		reads = 1;
+
+	table.header = NULL;
+	if (shm_attach(&table, argv[1]))
+		return 1;
+
+	start = bench_nanos();
+	index = shm_find(&table, argv[2], &value);
+	elapsed = bench_nanos() - start;
+	if (index == -1) {
+		fprintf(stderr, "Module not in the table: %s\n", argv[2]);
+		shm_detach(&table);
+		return 1;
+	}
+	printf("Slot: %d, found in %lld ns, value: %s\n", index, elapsed, value.value);
+
+	first = value.count;
+	start = bench_nanos();
+	for (i = 0; i < reads; i++) {
+		if (shm_read(&table, index, &value))
+			failed++;
+	}
+	elapsed = bench_nanos() - start;
+
+	printf("Reads: %ld, %.1f ns per read, retries: %lu, failed: %ld, updates meanwhile: %llu\n"
+		, reads, (double)elapsed / reads, table.retries, failed, (unsigned long long)(value.count - first));
+
+	shm_detach(&table);
+	return 0;
+}
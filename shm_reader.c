@@ -0,0 +1,144 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "shm_reader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int shm_attach(struct shm_reader *table, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "Error: Can't open \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct shm_header)) {
+		fprintf(stderr, "Invalid shared table: %s\n", path);
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error: Can't map \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	table->header = map;
+	table->slots = (struct shm_slot *)(table->header + 1);
+	table->size = st.st_size;
+	table->retries = 0;
+	if (__atomic_load_n(&table->header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+			|| table->header->version != SHM_VERSION
+			|| table->header->slot_size != sizeof(struct shm_slot)) {
+		fprintf(stderr, "Invalid shared table: %s\n", path);
+		shm_detach(table);
+		return 1;
+	}
+	table->len = (st.st_size - sizeof(struct shm_header)) / sizeof(struct shm_slot);
+	if ((uint32_t)table->len > table->header->slots)
+		table->len = table->header->slots;
+
+	return 0;
+}
+
+// Copy of the slot at index, without locking the writer out.
+// Returns 1 if the slot is free, -1 if it never settled (the writer
+// died in the middle of an update).
+int shm_read(struct shm_reader *table, int index, struct shm_value *value)
+{
+	struct shm_slot *slot;
+	uint32_t seq;
+	int tries;
+
+	if (index < 0 || index >= table->len)
+		return 1;
+	slot = &table->slots[index];
+
+	for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			table->retries++;
+			continue;
+		}
+		memcpy(value->id, slot->id, SHM_ID_SIZE);
+		memcpy(value->value, slot->value, SHM_VALUE_SIZE);
+		value->len = slot->len;
+		value->updated = slot->updated;
+		value->count = slot->count;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		table->retries++;
+	}
+	if (tries == SHM_READ_TRIES)
+		return -1;
+
+	value->id[SHM_ID_SIZE - 1] = 0;
+	value->value[SHM_VALUE_SIZE - 1] = 0;
+	if (!value->id[0])
+		return 1;
+
+	return 0;
+}
+
+// Readers should keep the index and use shm_read afterwards, the slot
+// of a module only changes when the bridge restarts or the module is
+// removed, so check the id read back.
+// Returns the index of the module, -1 if it isn't in the table.
+int shm_find(struct shm_reader *table, const char *md_id, struct shm_value *value)
+{
+	uint32_t used;
+	int i;
+
+	used = __atomic_load_n(&table->header->used, __ATOMIC_ACQUIRE);
+	for (i = 0; i < table->len && (uint32_t)i < used; i++) {
+		if (strncmp(table->slots[i].id, md_id, SHM_ID_SIZE))
+			continue;
+		if (!shm_read(table, i, value) && !strcmp(value->id, md_id))
+			return i;
+	}
+
+	return -1;
+}
+
+void shm_detach(struct shm_reader *table)
+{
+	if (!table->header)
+		return;
+	munmap(table->header, table->size);
+	table->header = NULL;
+	table->slots = NULL;
+	table->len = 0;
+}
@@ -0,0 +1,89 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#ifndef SHM_READER_H
+#define SHM_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_MAGIC 0x4D425354
+#define SHM_VERSION 1
+#define SHM_ID_SIZE 8
+#define SHM_VALUE_SIZE 96
+#define SHM_READ_TRIES 100
+
+// Latest value of every module in a file under /dev/shm, one fixed size
+// slot per module index. The bridge is the only writer; each slot is a
+// seqlock so readers in other processes never block it and never take
+// a syscall once the file is mapped.
+//
+// A slot is being written while its seq is odd. A reader copies the slot,
+// then checks that seq was even and didn't move, or retries.
+//
+// This side has no other dependency, readers build it with their own
+// code: gcc -O2 reader.c shm_reader.c
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	int64_t started;				// Changes on every bridge restart, 0 once it exited
+	uint32_t used;					// Highest slot in use + 1
+	uint32_t pad;
+};
+
+struct shm_slot {
+	uint32_t seq;
+	uint32_t len;					// Length of the value, may exceed what fits
+	int64_t updated;
+	uint64_t count;					// Readings since the bridge started
+	char id[SHM_ID_SIZE];			// Empty when the slot is free
+	char value[SHM_VALUE_SIZE];
+};
+
+struct shm_reader {
+	struct shm_header *header;		// NULL when not attached
+	struct shm_slot *slots;
+	int len;						// Slots mapped
+	size_t size;
+	unsigned long retries;			// Reads that raced the writer
+};
+
+// A consistent copy of a slot
+struct shm_value {
+	char id[SHM_ID_SIZE];
+	char value[SHM_VALUE_SIZE];
+	uint32_t len;
+	int64_t updated;
+	uint64_t count;
+};
+
+int shm_attach(struct shm_reader *, const char *);
+int shm_read(struct shm_reader *, int, struct shm_value *);
+int shm_find(struct shm_reader *, const char *, struct shm_value *);
+void shm_detach(struct shm_reader *);
+
+#endif
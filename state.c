@@ -0,0 +1,140 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2013, Marcelo Aquino, https://github.com/mapnull
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in
+* all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+* THE SOFTWARE.
+*/
+
+#include "state.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+int state_save(struct bridge *bdev, char *path)
+{
+	char tmp[PATH_MAX];
+	struct device *dev;
+	FILE *fptr;
+	int i;
+
+	snprintf(tmp, PATH_MAX, "%s.tmp", path);
+	fptr = fopen(tmp, "w");
+	if (!fptr) {
+		fprintf(stderr, "Error opening state file for write \"%s\".\n", tmp);
+		return 1;
+	}
+
+	fprintf(fptr, "state,%d,%d,%d\n", STATE_VERSION, bdev->modules_len, bdev->modules_update);
+	for (i = 0; i < bdev->devices_len; i++) {
+		dev = &bdev->devices[i];
+		device_write(bdev, fptr, dev, true);
+		fprintf(fptr, "alive,%d,%d\n", dev->modules, dev->alive);
+	}
+
+	if (fflush(fptr) || fsync(fileno(fptr)) || ferror(fptr)) {
+		fprintf(stderr, "Error writing state file \"%s\": %s\n", tmp, strerror(errno));
+		fclose(fptr);
+		unlink(tmp);
+		return 1;
+	}
+	fclose(fptr);
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "Error replacing state file \"%s\": %s\n", path, strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	if (sync_dir(path) == -1) {
+		fprintf(stderr, "Error syncing state folder \"%s\": %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// Restore the devices of the last run. The file is removed once read,
+// it only describes the moment the bridge stopped.
+// Returns the number of devices, -1 on memory problems.
+int state_load(struct bridge *bdev, char *path)
+{
+	FILE *fptr;
+	char buf[1024];
+	char dev_id[DEVICE_ID_SIZE + 1];
+	struct device *dev = NULL;
+	bool replayed = false;
+	int version, modules_len, modules_update, modules, alive;
+	int rc, cnt = 0;
+
+	fptr = fopen(path, "rt");
+	if (!fptr)
+		return 0;
+
+	if (!fgets(buf, 1024, fptr) || sscanf(buf, "state,%d,%d,%d", &version, &modules_len, &modules_update) != 3
+			|| version != STATE_VERSION) {
+		fprintf(stderr, "Invalid state file: %s\n", path);
+		fclose(fptr);
+		unlink(path);
+		return 0;
+	}
+
+	while (fgets(buf, 1024, fptr)) {
+		if (!strncmp(buf, "device,", 7)) {
+			memcpy(dev_id, &buf[7], DEVICE_ID_SIZE);
+			dev_id[DEVICE_ID_SIZE] = 0;
+			// Devices changed in the journal are loaded already, and
+			// their modules are newer than the ones here
+			dev = device_get(bdev, dev_id);
+			replayed = dev != NULL;
+			if (!dev) {
+				rc = device_load_line(bdev, dev_id, buf);
+				if (rc == -1) {
+					fclose(fptr);
+					return -1;
+				}
+				// Its module may be gone, skip the whole device then
+				dev = rc ? NULL : device_get(bdev, dev_id);
+			}
+			if (dev)
+				cnt++;
+		} else if (!dev) {
+			continue;
+		} else if (!strncmp(buf, "alive,", 6)) {
+			if (sscanf(&buf[6], "%d,%d", &modules, &alive) == 2) {
+				dev->modules = modules;
+				dev->alive = alive;
+			}
+		} else if (!replayed && device_load_line(bdev, dev_id, buf) == -1) {
+			fclose(fptr);
+			return -1;
+		}
+	}
+	fclose(fptr);
+	unlink(path);
+
+	// Same modules as before, the controllers already know them
+	if (modules_len == bdev->modules_len)
+		bdev->modules_update = modules_update;
+
+	return cnt;
+}
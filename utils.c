@@ -29,6 +29,9 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
 
 int getInt(char **buf, int *number)
 {
@@ -109,6 +112,41 @@ int getString(char **buf, char *str, int size, char lim)
 	return cnt;
 }
 
+// Monotonic clock in msecs, not affected by date changes
+long long getMillis(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Flush the directory holding path, a rename is only durable once its
+// directory entry is on disk too.
+// Returns 0 on success, -1 with errno set otherwise.
+int sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd, rc;
+
+	snprintf(dir, PATH_MAX, "%s", path);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = 0;
+	else
+		*slash = 0;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -1;
+	rc = fsync(fd);
+	close(fd);
+	return rc;
+}
+
 int run_script(char *dir, char *scriptName, char *output, int output_max_size, int debug)
 {
 	FILE *pf;
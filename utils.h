@@ -30,5 +30,7 @@
 int getInt(char **, int *);
 int getString(char **, char *, int, char);
 int run_script(char *, char *, char *, int, int);
+long long getMillis(void);
+int sync_dir(const char *);
 
 #endif